@@ -0,0 +1,246 @@
+#pragma once
+
+#include "minecraft/LevelStorage.h"
+#include "minecraft/leveldb/snappy_compressor.h"
+#include "minecraft/leveldb/zlib_compressor.h"
+#include "minecraft/leveldb/zstd_compressor.h"
+#include <CompressorInstall.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Meta-compressor that picks a codec per block. Each block is classified by the first key it holds: chunk terrain,
+// actors, player NBT or other. For each class the compressor keeps running estimates of every candidate's ratio and
+// its compression and decompression cost. The first `warmup` blocks of a class and every `sampleEvery`-th one after
+// that are compressed with all candidates to refresh the estimates. Every other block only runs the class's current
+// choice.
+//
+// The choice minimises the estimated cost per input byte:
+//   ratio * (weights.space + weights.io * reads) + compress + reads * decompress
+// Here `reads` is how often blocks of the class have been read back per block written. Hot classes therefore lean
+// towards codecs that decompress fast, and cold classes towards dense ones, as far as weights.space values disk.
+//
+// Blocks are stored under this compressor's SERIALIZE_ID with one extra byte holding the chosen candidate's id. The
+// DB's other compressors keep reading blocks written before install(). The reverse does not hold: a server without the
+// mod has no compressor for id 17 and reports every block written under it as corrupt, so only remove the mod after a
+// full compaction with it uninstalled has rewritten them.
+//
+//   AdaptiveCompressor::install(AdaptiveCompressor::standard());
+struct AdaptiveCompressor : leveldb::Compressor {
+  static const char SERIALIZE_ID = 17; // clear of the server's ids (1-4) and ZstdDictCompressor's
+  static constexpr unsigned maxCandidates = 8;
+
+  enum KeyClass : unsigned { Terrain, Actor, Player, Other, KeyClasses };
+  static constexpr const char *classNames[KeyClasses] = { "terrain", "actor", "player", "other" };
+
+  struct Weights {
+    double space = 1.0; // nanoseconds one stored byte is worth
+    double io    = 2.0; // nanoseconds to read one stored byte back
+  };
+
+  // Per input byte, averaged over the class's sampled blocks.
+  struct Estimate {
+    double ratio = 0, compressNanos = 0, decompressNanos = 0;
+    std::uint32_t samples = 0;
+  };
+
+  struct ClassState {
+    Estimate estimates[maxCandidates];
+    std::atomic<std::uint8_t> choice{ 0 };
+    std::atomic<std::uint64_t> writes{ 0 }, reads{ 0 };
+  };
+
+  Weights weights;
+  unsigned warmup      = 8;
+  unsigned sampleEvery = 64;
+
+  leveldb::Compressor *candidates[maxCandidates]{};
+  const char *names[maxCandidates]{};
+  unsigned candidateCount = 0;
+  leveldb::Compressor *byId[256]{};
+  std::vector<std::unique_ptr<leveldb::Compressor>> owned;
+
+  mutable std::mutex sampleMutex;
+  mutable ClassState classes[KeyClasses];
+
+  AdaptiveCompressor() : Compressor(SERIALIZE_ID) {}
+  AdaptiveCompressor(AdaptiveCompressor const &) = delete;
+  AdaptiveCompressor &operator=(AdaptiveCompressor const &) = delete;
+
+  // Candidates must have distinct ids. The first one added is used until a class has been sampled.
+  bool add(leveldb::Compressor *compressor, const char *name) {
+    auto id = (unsigned char)compressor->uniqueCompressionID;
+    if (candidateCount == maxCandidates || byId[id] || id == (unsigned char)SERIALIZE_ID) return false;
+    names[candidateCount]        = name;
+    candidates[candidateCount++] = compressor;
+    byId[id]                     = compressor;
+    return true;
+  }
+  bool add(std::unique_ptr<leveldb::Compressor> compressor, const char *name) {
+    if (!add(compressor.get(), name)) return false;
+    owned.push_back(std::move(compressor));
+    return true;
+  }
+
+  // The server's codecs, fastest first. ZopfliCompressor is left out: sampling runs every candidate on the writing or
+  // compaction thread, and zopfli would stall it for orders of magnitude longer than zlib. It writes zlib streams under
+  // ZlibCompressor's SERIALIZE_ID (2), so add() refuses whichever of the two comes second.
+  static std::unique_ptr<AdaptiveCompressor> standard() {
+    auto compressor = std::make_unique<AdaptiveCompressor>();
+    compressor->add(std::make_unique<leveldb::SnappyCompressor>(), "snappy");
+    compressor->add(std::make_unique<leveldb::ZstdCompressor>(), "zstd");
+    compressor->add(std::make_unique<leveldb::ZlibCompressorRaw>(), "zlib-raw");
+    return compressor;
+  }
+
+  void compressImpl(const char *input, size_t length, std::string &output) const override {
+    auto &state   = classes[classify(input, length)];
+    auto written  = state.writes.fetch_add(1, std::memory_order_relaxed);
+    auto &scratch = buffers()[0];
+    unsigned pick = state.choice.load(std::memory_order_relaxed);
+    if ((written < warmup || written % sampleEvery == 0) && sample(state, input, length, pick)) {
+      scratch.swap(buffers()[1 + pick]);
+    } else {
+      scratch.clear();
+      candidates[pick]->compressImpl(input, length, scratch);
+    }
+    output.assign(1, candidates[pick]->uniqueCompressionID);
+    output += scratch;
+  }
+
+  bool decompress(const char *input, size_t length, std::string &output) const override {
+    if (!length) return false;
+    auto candidate = byId[(unsigned char)input[0]];
+    if (!candidate || !candidate->decompress(input + 1, length - 1, output)) return false;
+    // Reads are counted in batches from a thread-local tick, so readers do not share a counter line on every block.
+    static thread_local unsigned tick = 0;
+    if (++tick % readBatch == 0) classes[classify(output.data(), output.size())].reads.fetch_add(readBatch, std::memory_order_relaxed);
+    return true;
+  }
+
+  void dump(std::ostream &os) const {
+    std::lock_guard lock(sampleMutex);
+    for (unsigned c = 0; c < KeyClasses; c++) {
+      auto &state  = classes[c];
+      auto writes  = state.writes.load(std::memory_order_relaxed);
+      auto reads   = state.reads.load(std::memory_order_relaxed);
+      auto current = state.choice.load(std::memory_order_relaxed);
+      if (!writes) continue;
+      os << classNames[c] << ": " << writes << " blocks written, ~" << reads << " read, using " << names[current] << '\n';
+      for (unsigned i = 0; i < candidateCount; i++) {
+        auto &e = state.estimates[i];
+        if (e.samples)
+          os << "  " << names[i] << ": ratio " << e.ratio << ", compress " << e.compressNanos << "ns/B, decompress " << e.decompressNanos << "ns/B over " << e.samples
+             << " samples\n";
+      }
+    }
+    os.flush();
+  }
+
+  // Makes `compressor` the one every DB opened from now on writes with. Its candidates are also registered for reading
+  // if the DB does not have them yet. The compressor lives until exit, since the DB keeps raw pointers to it. If another
+  // mod's compressor, such as ZstdDictCompressor, already writes, this one only reads (see attachCompressors()).
+  static void install(std::unique_ptr<AdaptiveCompressor> compressor) {
+    instance() = std::move(compressor);
+    void (*attach)(leveldb::Options const *&, std::string const *&, leveldb::DB **&) = [](leveldb::Options const *&options, std::string const *&name, leveldb::DB **&) {
+      auto self = instance().get();
+      if (!self) return;
+      attachCompressors(options, *name, self, { self->candidates, self->candidates + self->candidateCount });
+    };
+    DBOpenChain::get().addRewrite(DBOpenSymbol, 0, (void *)attach);
+  }
+
+  static std::unique_ptr<AdaptiveCompressor> &instance() {
+    static std::unique_ptr<AdaptiveCompressor> compressor;
+    return compressor;
+  }
+
+  // A data block's first entry stores its internal key whole: varint shared (0), varint key size, varint value size,
+  // then the user key followed by 8 bytes of sequence number and type.
+  static KeyClass classify(const char *block, std::size_t length) {
+    auto p = block, end = block + length;
+    std::uint32_t shared, keySize, valueSize;
+    if (!varint(p, end, shared) || !varint(p, end, keySize) || !varint(p, end, valueSize) || shared || keySize < 8 || keySize > std::size_t(end - p)) return Other;
+    std::string_view key{ p, keySize - 8 };
+    if (key.compare(0, 6, "player") == 0 || key == "~local_player") return Player;
+    if (key.compare(0, 11, "actorprefix") == 0) return Actor;
+    // Chunk keys: x, z[, dimension] as int32, the record tag, and for SubChunkPrefix the subchunk index.
+    if (key.size() == 9 || key.size() == 10 || key.size() == 13 || key.size() == 14) {
+      auto tag = (unsigned char)key[key.size() <= 10 ? 8 : 12];
+      if (tag == 49 || tag == 50) return Actor; // BlockEntity, Entity
+      if ((tag >= 43 && tag <= 64) || tag == 118) return Terrain;
+    }
+    return Other;
+  }
+
+private:
+  static constexpr unsigned readBatch = 16;
+
+  using clock = std::chrono::steady_clock;
+
+  // [0] holds the output, [1 + i] candidate i's output while sampling, and the last one decompression scratch.
+  static std::string *buffers() {
+    static thread_local std::string list[maxCandidates + 2];
+    return list;
+  }
+
+  static bool varint(const char *&p, const char *end, std::uint32_t &value) {
+    value = 0;
+    for (unsigned shift = 0; shift <= 28 && p < end; shift += 7) {
+      auto byte = (unsigned char)*p++;
+      value |= std::uint32_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  // Runs every candidate on the block and updates the class's choice. Skipped, returning false, while another thread
+  // is sampling. On success `pick` is the new choice and its output is in buffers()[1 + pick].
+  bool sample(ClassState &state, const char *input, std::size_t length, unsigned &pick) const {
+    std::unique_lock lock(sampleMutex, std::try_to_lock);
+    if (!lock || !length) return false;
+    auto scratch = buffers();
+    auto &check  = scratch[maxCandidates + 1];
+    bool valid[maxCandidates]{};
+    for (unsigned i = 0; i < candidateCount; i++) {
+      auto &out   = scratch[1 + i];
+      auto start  = clock::now();
+      out.clear();
+      candidates[i]->compressImpl(input, length, out);
+      auto middle = clock::now();
+      check.clear();
+      if (!candidates[i]->decompress(out.data(), out.size(), check) || check.size() != length) continue;
+      auto end    = clock::now();
+      valid[i]    = true;
+      auto &e     = state.estimates[i];
+      double rate = 1.0 / std::min<std::uint32_t>(++e.samples, 16); // running mean, then a moving one
+      auto blend  = [&](double &value, double sample) { value += (sample - value) * rate; };
+      blend(e.ratio, (double)out.size() / length);
+      blend(e.compressNanos, std::chrono::duration<double, std::nano>(middle - start).count() / length);
+      blend(e.decompressNanos, std::chrono::duration<double, std::nano>(end - middle).count() / length);
+    }
+    auto writes = state.writes.load(std::memory_order_relaxed);
+    double reads = (double)state.reads.load(std::memory_order_relaxed) / (writes ? writes : 1);
+    double best  = 0;
+    bool found   = false;
+    for (unsigned i = 0; i < candidateCount; i++) {
+      auto &e = state.estimates[i];
+      if (!valid[i]) continue;
+      double cost = e.ratio * (weights.space + weights.io * reads) + e.compressNanos + reads * e.decompressNanos;
+      if (!found || cost < best) {
+        best  = cost;
+        pick  = i;
+        found = true;
+      }
+    }
+    if (!found) return false;
+    state.choice.store((std::uint8_t)pick, std::memory_order_relaxed);
+    return true;
+  }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "minecraft/LevelStorage.h"
+#include <HookChain.h>
+#include <StaticHook.h>
+#include <TaskPool.h>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Env whose Schedule() runs leveldb's background work on a TaskPool instead of leveldb's single background thread, and
+// whose StartThread() starts a detached thread. Every other call goes to the wrapped Env.
+struct PooledEnv : leveldb::EnvWrapper {
+  TaskPool &pool;
+
+  PooledEnv(leveldb::Env *target, TaskPool &pool) : EnvWrapper(target), pool(pool) {}
+
+  void Schedule(void (*f)(void *), void *a) override {
+    pool.submit([f, a] { f(a); });
+  }
+  // StartThread bodies run for the lifetime of the DB, so they would pin a pool worker for good.
+  void StartThread(void (*f)(void *), void *a) override { std::thread(f, a).detach(); }
+};
+
+// Splits a DB's key space into ranges holding about the same number of bytes on disk. Boundaries are one-byte key
+// prefixes, refined to two bytes where a single prefix holds more than half a range. The first byte of a chunk key is
+// the low byte of its x coordinate, so a world spreads well over them. Sizes come from GetApproximateSizes and read no
+// data.
+struct CompactionSplitter {
+  // An empty begin means from the first key, an empty end up to the last.
+  struct KeyRange {
+    std::string begin, end;
+    std::uint64_t bytes;
+  };
+
+  static std::vector<KeyRange> split(leveldb::DB &db, unsigned parts) {
+    std::vector<std::string> bounds;
+    for (unsigned b = 0; b < 256; b++) bounds.emplace_back(1, (char)b);
+    bounds.emplace_back(16, '\xff');
+    auto coarse         = sizes(db, bounds);
+    std::uint64_t total = 0;
+    for (auto bytes : coarse) total += bytes;
+    if (parts < 2 || !total) return { KeyRange{ {}, {}, total } };
+
+    std::vector<std::pair<std::string, std::uint64_t>> buckets; // start, bytes
+    for (unsigned b = 0; b < 256; b++) {
+      if (coarse[b] <= total / parts / 2) {
+        buckets.emplace_back(bounds[b], coarse[b]);
+        continue;
+      }
+      // The first fine bucket starts at the prefix itself, so it also holds the one-byte key and prefix + '\0' keys.
+      std::vector<std::string> fine{ bounds[b] };
+      for (unsigned c = 1; c < 256; c++) fine.push_back(bounds[b] + (char)c);
+      fine.push_back(bounds[b + 1]);
+      auto bytes = sizes(db, fine);
+      for (unsigned c = 0; c < 256; c++) buckets.emplace_back(fine[c], bytes[c]);
+    }
+
+    std::vector<KeyRange> ranges;
+    std::string begin;
+    std::uint64_t bytes = 0, done = 0;
+    for (auto &[start, size] : buckets) {
+      // Cut where the running total crosses the next multiple of total / parts.
+      if (bytes && ranges.size() + 1 < parts && done + bytes >= total * (ranges.size() + 1) / parts) {
+        ranges.push_back(KeyRange{ begin, start, bytes });
+        done += bytes;
+        begin = start;
+        bytes = 0;
+      }
+      bytes += size;
+    }
+    ranges.push_back(KeyRange{ begin, {}, bytes });
+    return ranges;
+  }
+
+  // Compacts the ranges one after another, calling progress(done, total) after each. leveldb runs one compaction per DB
+  // at a time, so the ranges cannot overlap in time. Writes and memtable flushes can still run between them instead of
+  // waiting behind one compaction of the whole DB.
+  static void compact(leveldb::DB &db, std::vector<KeyRange> const &ranges, std::function<void(std::size_t, std::size_t)> const &progress = {}) {
+    for (std::size_t i = 0; i < ranges.size(); i++) {
+      leveldb::Slice begin{ ranges[i].begin }, end{ ranges[i].end };
+      db.CompactRange(ranges[i].begin.empty() ? nullptr : &begin, ranges[i].end.empty() ? nullptr : &end);
+      if (progress) progress(i + 1, ranges.size());
+    }
+  }
+
+private:
+  // bytes[i] covers [bounds[i], bounds[i + 1]).
+  static std::vector<std::uint64_t> sizes(leveldb::DB &db, std::vector<std::string> const &bounds) {
+    std::vector<leveldb::Range> ranges;
+    for (std::size_t i = 0; i + 1 < bounds.size(); i++) ranges.emplace_back(bounds[i], bounds[i + 1]);
+    std::vector<std::uint64_t> bytes(ranges.size());
+    db.GetApproximateSizes(ranges.data(), (int)ranges.size(), bytes.data());
+    return bytes;
+  }
+};
+
+// Runs DBStorage's background compactions on a TaskPool of its own. It also makes compactStorage() compact the world
+// in `slices` size-balanced key ranges. The storage's compaction callback sees one CompactionStatus::Start/Complete pair
+// around all of them, as it would for the server's own compaction; the `progress` given to install() hears about each
+// slice.
+//
+// leveldb itself runs at most one compaction per DB at a time, so the pool does not split a single compaction across
+// cores. What it does:
+// - several DBs compact in parallel, as they would not on leveldb's one shared thread;
+// - a slow compaction no longer holds up other background work queued behind it;
+// - no single manual compaction stalls writes for the whole world.
+//
+//   CompactionPool::install(2, 16);
+struct CompactionPool {
+  using Progress = std::function<void(std::size_t done, std::size_t total)>;
+
+  TaskPool pool;
+  unsigned const slices;
+  Progress const progress;
+  std::mutex envMutex;
+  std::vector<std::unique_ptr<PooledEnv>> envs;
+
+  CompactionPool(unsigned threads, unsigned slices, Progress progress = {}) : pool(threads), slices(slices), progress(std::move(progress)) {}
+
+  static std::unique_ptr<CompactionPool> &instance() {
+    static std::unique_ptr<CompactionPool> pool;
+    return pool;
+  }
+
+  using ListenerChain = THookChainFor(_ZN21CompactionListenerEnvC2EPN7leveldb3EnvE, void(CompactionListenerEnv *, leveldb::Env *));
+
+  // Call before the level loads. `progress`, if set, is called with (done, total) after each slice of compactStorage(),
+  // on the thread running it.
+  static void install(unsigned threads = 2, unsigned slices = 16, Progress progress = {}) {
+    instance() = std::make_unique<CompactionPool>(std::max(1u, threads), std::max(1u, slices), std::move(progress));
+    void (*adopt)(CompactionListenerEnv *&, leveldb::Env *&) = [](CompactionListenerEnv *&, leveldb::Env *&target) {
+      if (auto self = instance().get()) target = self->wrap(target);
+    };
+    ListenerChain::get().addRewrite("_ZN21CompactionListenerEnvC2EPN7leveldb3EnvE", 0, (void *)adopt);
+    StaticHookRegistry::get().add("_ZN9DBStorage14compactStorageEv", (void *)&compactStorage, (void **)&originalCompactStorage);
+  }
+
+  // The PooledEnv over `target`, made on first use. DBStorage's CompactionListenerEnv is built on it, so the listener
+  // still sees every job it schedules, and the pool is in place before DB::Open starts any background work.
+  leveldb::Env *wrap(leveldb::Env *target) {
+    std::lock_guard lock(envMutex);
+    for (auto &env : envs)
+      if (env.get() == target || env->target() == target) return env.get();
+    envs.push_back(std::make_unique<PooledEnv>(target, pool));
+    return envs.back().get();
+  }
+
+private:
+  inline static void (*originalCompactStorage)(DBStorage *);
+
+  // Replaces DBStorage::compactStorage() outright rather than wrapping it: anything the server's version does besides
+  // compacting the DB is skipped. The slices are compacted synchronously with CompactRange on whichever thread called
+  // it, which blocks until the last one is done; the background pool only runs the flushes and compactions leveldb
+  // schedules meanwhile.
+  static void compactStorage(DBStorage *storage) {
+    auto self = instance().get();
+    if (!self || !storage->db || self->slices < 2) return originalCompactStorage(storage);
+    auto ranges   = CompactionSplitter::split(*storage->db, self->slices);
+    auto listener = storage->compactionListenerEnv.get();
+    if (listener) listener->notifyStart();
+    CompactionSplitter::compact(*storage->db, ranges, self->progress);
+    if (listener) listener->notifyComplete();
+  }
+};
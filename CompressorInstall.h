@@ -0,0 +1,54 @@
+#pragma once
+
+#include "minecraft/LevelStorage.h"
+#include <HookChain.h>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Shared with every other user of DB::Open, so they all sit on one trampoline. References are spelled as pointers,
+// which they are in the ABI.
+using DBOpenChain = THookChainFor(_ZN7leveldb2DB4OpenERKNS_7OptionsERKNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEEPPS0_,
+                                  leveldb::Status(leveldb::Options const *, std::string const *, leveldb::DB **));
+inline constexpr const char *DBOpenSymbol = "_ZN7leveldb2DB4OpenERKNS_7OptionsERKNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEEPPS0_";
+
+// For a rewrite callback on DBOpenChain: points `options` at a copy with `writer` as compressors[0], the one leveldb
+// writes with, and `readers` appended after the existing compressors. The server's compressors move down but stay
+// readable. Compressors whose id the DB already has are skipped, and so is everything if the writer's id is there.
+// `writer` may be null to only add readers.
+//
+// The caller's Options are left alone. DBImpl copies its Options, so the thread-local copy only has to outlive the call;
+// a second installer on the same DB::Open edits that copy in place. If another mod's compressor (an id above the
+// server's 1-4) already holds compressors[0], `writer` is only added for reading and this says so on stderr: whichever
+// installer hooked DB::Open first writes.
+inline void attachCompressors(leveldb::Options const *&options, std::string const &name, leveldb::Compressor *writer, std::vector<leveldb::Compressor *> const &readers) {
+  std::size_t end = 0;
+  while (end < 256 && options->compressors[end]) {
+    if (writer && options->compressors[end]->uniqueCompressionID == writer->uniqueCompressionID) return;
+    end++;
+  }
+  if (end == 256) return;
+  static thread_local std::optional<leveldb::Options> copy;
+  if (!copy || options != &*copy) copy.emplace(*options);
+  auto &slots  = copy->compressors;
+  auto present = [&](leveldb::Compressor *compressor) {
+    for (std::size_t i = 0; i < end; i++)
+      if (slots[i]->uniqueCompressionID == compressor->uniqueCompressionID) return true;
+    return false;
+  };
+  if (writer && end && (unsigned char)slots[0]->uniqueCompressionID > 4) {
+    std::cerr << "[DB::Open] " << name << " is already written with compressor " << (int)slots[0]->uniqueCompressionID << " of another mod, compressor "
+              << (int)writer->uniqueCompressionID << " only reads" << std::endl;
+    slots[end++] = writer;
+  } else if (writer) {
+    memmove(&slots[1], &slots[0], end * sizeof(slots[0]));
+    slots[0] = writer;
+    end++;
+  }
+  for (auto reader : readers)
+    if (end < 256 && !present(reader)) slots[end++] = reader;
+  options = &*copy;
+}
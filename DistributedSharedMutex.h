@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+// Reader-biased alternative to SharedMutex (std::shared_timed_mutex) for read-mostly mod tables such as permission
+// caches or player lookups. Readers only touch their own cache line: each thread is pinned to one of slotCount reader
+// counters, so concurrent readers on different cores never contend. A writer raises a flag that turns new readers
+// away and then waits for every counter to drain, which makes lock() cost O(slotCount) — keep writes rare.
+//
+// Same lock/try_lock/lock_shared interface, so it works with std::unique_lock and std::shared_lock. Waiting spins with
+// yield, so hold it only for short critical sections.
+struct DistributedSharedMutex {
+  static constexpr std::size_t slotCount = 32;
+  struct alignas(64) Slot {
+    std::atomic<unsigned> readers{ 0 };
+  };
+
+  Slot slots[slotCount];
+  alignas(64) std::atomic<bool> writer{ false };
+
+  DistributedSharedMutex() {}
+  DistributedSharedMutex(DistributedSharedMutex const &) = delete;
+  DistributedSharedMutex &operator=(DistributedSharedMutex const &) = delete;
+
+  void lock() {
+    while (!try_acquire_writer()) std::this_thread::yield();
+    for (auto &slot : slots)
+      while (slot.readers.load(std::memory_order_seq_cst)) std::this_thread::yield();
+  }
+
+  bool try_lock() {
+    if (!try_acquire_writer()) return false;
+    for (auto &slot : slots)
+      if (slot.readers.load(std::memory_order_seq_cst)) {
+        writer.store(false, std::memory_order_release);
+        return false;
+      }
+    return true;
+  }
+
+  void unlock() { writer.store(false, std::memory_order_release); }
+
+  void lock_shared() {
+    while (!try_lock_shared())
+      while (writer.load(std::memory_order_relaxed)) std::this_thread::yield();
+  }
+
+  // The increment and the writer check are both seq_cst, so either the writer sees our count or we see its flag.
+  bool try_lock_shared() {
+    auto &slot = mySlot();
+    slot.readers.fetch_add(1, std::memory_order_seq_cst);
+    if (!writer.load(std::memory_order_seq_cst)) return true;
+    slot.readers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+
+  void unlock_shared() { mySlot().readers.fetch_sub(1, std::memory_order_release); }
+
+private:
+  bool try_acquire_writer() {
+    bool expected = false;
+    return !writer.load(std::memory_order_relaxed) && writer.compare_exchange_strong(expected, true, std::memory_order_seq_cst, std::memory_order_relaxed);
+  }
+
+  // Threads get slots round-robin on first use and keep them, so unlock_shared() finds the counter lock_shared() used.
+  Slot &mySlot() {
+    static std::atomic<std::size_t> next{ 0 };
+    static thread_local std::size_t index = next.fetch_add(1, std::memory_order_relaxed) % slotCount;
+    return slots[index];
+  }
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <StaticHook.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+template <typename T> using HookChainResult = std::conditional_t<std::is_void_v<T>, std::nullptr_t, std::add_lvalue_reference_t<T>>;
+
+// Which chain owns the trampoline on each symbol, shared by every mod like the chains themselves. Only used to report a
+// second chain on a symbol, which would stack a second trampoline.
+struct __attribute__((visibility("default"))) HookChainOwners {
+  static bool claim(const char *sym, void const *chain) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, void const *> owners;
+    std::lock_guard lock(mutex);
+    auto [it, inserted] = owners.emplace(sym, chain);
+    if (inserted || it->second == chain) return true;
+    std::cerr << "[HookChain] " << sym << " is already chained under another tag or signature; a second trampoline is stacked on it" << std::endl;
+    return false;
+  }
+};
+
+// One trampoline per target symbol: every pre/post subscriber is kept in a priority-sorted array and called inline from a
+// single dispatch function. The chain lives in a function-local static with default visibility, so it is shared by every
+// mod hooking the same symbol with the same signature. Callbacks run in ascending priority, ties in registration order.
+//
+// A chain is keyed by (Tag, signature). The T*Hook* macros derive the tag from the mangled name, and code adding
+// callbacks at runtime should use the same one through THookChainFor, so all of them land on one trampoline.
+//
+// Callbacks take every argument as an lvalue reference, a pre callback as void(Args &...) and a post one as
+// void(HookChainResult<Ret>, Args &...), so nothing is copied per callback and move-only parameters work. The original is
+// called once with the arguments forwarded, so post callbacks see a by-value argument after it was moved from.
+// Non-trivial by-value parameters may be spelled as references in the signature, which they are in the ABI.
+//
+// Rewrite callbacks (addRewrite) run before every pre one, so they can hand the original, and every callback after them,
+// different arguments: a copy of a const argument with changes, say.
+//
+// The callback lists are immutable snapshots published through an atomic pointer: add() copies, inserts and swaps, so
+// a mod loading late can subscribe while dispatch() runs on other threads. Replaced snapshots are never freed, since a
+// dispatch may still be walking them; a chain only ever sees a handful of add() calls.
+template <typename Tag, typename Fn> struct HookChain;
+
+template <typename Tag, typename Ret, typename... Args> struct __attribute__((visibility("default"))) HookChain<Tag, Ret(Args...)> {
+  using Result = HookChainResult<Ret>;
+  struct Callback {
+    int priority;
+    bool member;
+    void *fn;
+  };
+  struct Callbacks {
+    std::vector<Callback> rewrite, pre, post;
+  };
+
+  Ret (*original)(Args...) = nullptr;
+  const char *symbol       = nullptr; // set by the first add(), which hands the trampoline to StaticHookRegistry
+  std::atomic<Callbacks const *> callbacks{ new Callbacks };
+  std::mutex mutex;
+
+  static HookChain &get() {
+    static HookChain chain;
+    return chain;
+  }
+
+  // Whether the trampoline is in place. It may be queued for a later phase, or its symbol missing, after add().
+  bool installed() const { return original != nullptr; }
+
+  static Ret dispatch(Args... args) {
+    auto &chain = get();
+    auto list   = chain.callbacks.load(std::memory_order_acquire);
+    for (auto &cb : list->rewrite) ((void (*)(Args &...))cb.fn)(args...);
+    for (auto &cb : list->pre) ((void (*)(Args &...))cb.fn)(args...);
+    if constexpr (std::is_void_v<Ret>) {
+      chain.original(std::forward<Args>(args)...);
+      for (auto &cb : list->post) call(cb, nullptr, args...);
+    } else {
+      Ret result = chain.original(std::forward<Args>(args)...);
+      for (auto &cb : list->post) call(cb, result, args...);
+      return result;
+    }
+  }
+
+  void add(const char *sym, bool isPost, bool member, int priority, void *fn) { insert(sym, isPost ? &Callbacks::post : &Callbacks::pre, member, priority, fn); }
+
+  void addRewrite(const char *sym, int priority, void *fn) { insert(sym, &Callbacks::rewrite, false, priority, fn); }
+
+private:
+  void insert(const char *sym, std::vector<Callback> Callbacks::*which, bool member, int priority, void *fn) {
+    std::lock_guard lock(mutex);
+    if (symbol && strcmp(symbol, sym) != 0) {
+      std::cerr << "[HookChain] " << sym << " added to the chain of " << symbol << std::endl;
+      std::abort();
+    }
+    auto next  = new Callbacks(*callbacks.load(std::memory_order_relaxed));
+    auto &list = next->*which;
+    auto it    = std::upper_bound(list.begin(), list.end(), priority, [](int p, Callback const &cb) { return p < cb.priority; });
+    list.insert(it, Callback{ priority, member, fn });
+    callbacks.store(next, std::memory_order_release);
+    if (symbol) return;
+    symbol = sym;
+    HookChainOwners::claim(sym, this);
+    StaticHookRegistry::get().add(sym, (void *)&dispatch, (void **)&original);
+  }
+
+  static void call(Callback const &cb, Result result, Args &... args) {
+    if constexpr (sizeof...(Args) > 0) {
+      if (cb.member) return callMember(cb.fn, result, args...);
+    }
+    ((void (*)(Result, Args &...))cb.fn)(result, args...);
+  }
+
+  // instance post hooks take the result after `this`
+  template <typename Self, typename... Rest> static void callMember(void *fn, Result result, Self &self, Rest &... rest) {
+    ((void (*)(Self, Result, Rest &...))fn)(self, result, rest...);
+  }
+};
+
+// The chain the T*Hook* macros build for `sym`, for code that adds callbacks at runtime:
+//
+//   using OpenChain = THookChainFor(_ZN7leveldb2DB4Open..., leveldb::Status(leveldb::Options const *, ...));
+//
+// Expand it at namespace or class scope; the tag is declared by the expansion, and inside a function body it would be a
+// local class of its own.
+#define THookChainFor(sym, fn...) HookChain<struct _THookChain_##sym, fn>
+
+// Adapt a T*Hook* macro body to the callback convention above: the body gets its parameters as declared, copied from
+// the lvalues only where it takes them by value.
+template <auto Hook> struct HookChainPre;
+template <typename... Params, void (*Hook)(Params...)> struct HookChainPre<Hook> {
+  static void call(Params &... params) { Hook(params...); }
+};
+template <typename H, typename... Params, void (H::*Hook)(Params...)> struct HookChainPre<Hook> {
+  static void call(H *&self, Params &... params) { (self->*Hook)(params...); }
+};
+
+template <auto Hook> struct HookChainPost;
+template <typename Result, typename... Params, void (*Hook)(Result, Params...)> struct HookChainPost<Hook> {
+  static void call(Result result, Params &... params) { Hook(result, params...); }
+};
+template <typename H, typename Result, typename... Params, void (H::*Hook)(Result, Params...)> struct HookChainPost<Hook> {
+  static void call(Result result, H *&self, Params &... params) { (self->*Hook)(result, params...); }
+};
+
+struct RegisterHookChain {
+  template <typename Chain, typename T> RegisterHookChain(Chain &chain, const char *sym, bool isPost, bool member, int priority, T fn) {
+    union {
+      T a;
+      void *b;
+    } fnUnion;
+    fnUnion.a = fn;
+    chain.add(sym, isPost, member, priority, fnUnion.b);
+  }
+};
+
+#define _TChainUnwrap(x...) x
+#define _TChainHook(class_inh, iname, sym, priority, isPost, ret, fn, decl)                                                                          \
+  struct _THookChain_##sym;                                                                                                                          \
+  struct _TChainHook_##iname class_inh {                                                                                                             \
+    using chain = HookChain<_THookChain_##sym, _TChainUnwrap fn>;                                                                                    \
+    template <typename... Params> static ret original(Params &&... params) { return chain::get().original(std::forward<Params>(params)...); }        \
+    _TChainUnwrap decl;                                                                                                                              \
+  };                                                                                                                                                 \
+  static RegisterHookChain _TRChainHook_##iname(_TChainHook_##iname::chain::get(), #sym, isPost, false, priority,                                    \
+                                                &std::conditional_t<isPost, HookChainPost<&_TChainHook_##iname::_hook>,                              \
+                                                                    HookChainPre<&_TChainHook_##iname::_hook>>::call);
+
+#define THookPre(iname, priority, ret, sym, args...)                                                                                                 \
+  _TChainHook(, iname, sym, priority, false, ret, (ret(args)), (static void _hook(args)))                                                            \
+  void _TChainHook_##iname::_hook(args)
+#define THookPost(iname, priority, ret, sym, args...)                                                                                                \
+  _TChainHook(, iname, sym, priority, true, ret, (ret(args)), (static void _hook(HookChainResult<ret> _result, ##args)))                             \
+  void _TChainHook_##iname::_hook(HookChainResult<ret> _result, ##args)
+#define TInstanceHookPre(iname, priority, ret, sym, type, args...)                                                                                   \
+  _TChainHook( : public type, iname, sym, priority, false, ret, (ret(type *, ##args)), (void _hook(args)))                                           \
+  void _TChainHook_##iname::_hook(args)
+#define TInstanceHookPost(iname, priority, ret, sym, type, args...)                                                                                  \
+  _TChainHook( : public type, iname, sym, priority, true, ret, (ret(type *, ##args)), (void _hook(HookChainResult<ret> _result, ##args)))             \
+  void _TChainHook_##iname::_hook(HookChainResult<ret> _result, ##args)
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <ShardedThreadLocal.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <fcntl.h>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <x86intrin.h>
+
+// Runs a report on a thread of its own whenever a signal is raised. The handler only write(2)s one byte to a pipe, which
+// is async-signal-safe; the thread blocks on the other end and does the formatting, locking and allocating outside
+// signal context.
+struct SignalDump {
+  static bool on(int sig, void (*report)()) {
+    if (sig <= 0 || sig >= NSIG) return false;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return false;
+    std::thread([fd = fds[0], report] {
+      char byte;
+      for (;;) {
+        auto got = read(fd, &byte, 1);
+        if (got == 1)
+          report();
+        else if (got < 0 && errno == EINTR)
+          continue;
+        else
+          return;
+      }
+    }).detach();
+    writers()[sig].store(fds[1] + 1, std::memory_order_release);
+    struct sigaction action {};
+    action.sa_handler = [](int sig) {
+      auto saved = errno;
+      auto fd    = writers()[sig].load(std::memory_order_acquire) - 1;
+      if (fd >= 0) (void)!write(fd, "", 1);
+      errno = saved;
+    };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(sig, &action, nullptr) == 0;
+  }
+
+private:
+  // Write end of each signal's pipe plus one, so the zero-initialized table means none.
+  static std::atomic<int> *writers() {
+    static std::atomic<int> fds[NSIG];
+    return fds;
+  }
+};
+
+// Per-hook call counter and TSC cycle total, filled in by HookEntry when built with STATICHOOK_PROFILE.
+// Each thread counts into a slot of its own, written only by that thread with relaxed loads and stores, so a hook hit
+// from many worker threads never bounces a shared line between cores; dump() sums the slots. reset() records the sums
+// as a baseline instead of clearing slots other threads are writing. Stats link themselves into a list during static
+// initialization.
+struct HookStats {
+  struct Counters {
+    std::atomic<uint64_t> calls{ 0 };
+    std::atomic<uint64_t> cycles{ 0 };
+  };
+
+  const char *name;
+  ShardedThreadLocal<Counters> counters;
+  std::atomic<uint64_t> baseCalls{ 0 }, baseCycles{ 0 };
+  HookStats *next;
+
+  HookStats(const char *name) : name(name), next(head()) {
+    head() = this;
+    clockBase();
+  }
+
+  void record(uint64_t cycles) {
+    auto &local = counters.local();
+    local.calls.store(local.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    local.cycles.store(local.cycles.load(std::memory_order_relaxed) + cycles, std::memory_order_relaxed);
+  }
+
+  // Calls and cycles summed over every thread, since the last reset().
+  std::pair<uint64_t, uint64_t> totals() {
+    uint64_t calls = 0, cycles = 0;
+    counters.each([&](Counters &local) {
+      calls += local.calls.load(std::memory_order_relaxed);
+      cycles += local.cycles.load(std::memory_order_relaxed);
+    });
+    return { calls - baseCalls.load(std::memory_order_relaxed), cycles - baseCycles.load(std::memory_order_relaxed) };
+  }
+
+  static HookStats *&head() {
+    static HookStats *list = nullptr;
+    return list;
+  }
+
+  // TSC reading and steady clock time taken at the first registration, used to convert cycles to nanoseconds.
+  static std::pair<uint64_t, std::chrono::steady_clock::time_point> const &clockBase() {
+    static std::pair<uint64_t, std::chrono::steady_clock::time_point> base{ __rdtsc(), std::chrono::steady_clock::now() };
+    return base;
+  }
+
+  static double nanosPerCycle() {
+    auto &base  = clockBase();
+    auto cycles = __rdtsc() - base.first;
+    auto nanos  = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - base.second).count();
+    return cycles ? nanos / cycles : 0;
+  }
+
+  static void reset() {
+    for (auto it = head(); it; it = it->next) {
+      auto [calls, cycles] = it->totals();
+      it->baseCalls.fetch_add(calls, std::memory_order_relaxed);
+      it->baseCycles.fetch_add(cycles, std::memory_order_relaxed);
+    }
+  }
+
+  // Prints every hook that has been called, sorted by total time spent in it.
+  static void dump(std::ostream &os) {
+    struct Line {
+      HookStats *stats;
+      uint64_t calls, cycles;
+    };
+    std::vector<Line> list;
+    for (auto it = head(); it; it = it->next)
+      if (auto [calls, cycles] = it->totals(); calls) list.push_back(Line{ it, calls, cycles });
+    std::sort(list.begin(), list.end(), [](Line const &a, Line const &b) { return a.cycles > b.cycles; });
+    auto scale = nanosPerCycle();
+    for (auto &line : list) {
+      auto total = line.cycles * scale;
+      os << line.stats->name << ": " << line.calls << " calls, " << total / 1e6 << "ms total, " << total / line.calls << "ns avg\n";
+    }
+    os.flush();
+  }
+
+  // Dumps to stderr whenever the signal is raised, from a SignalDump thread.
+  static bool dumpOnSignal(int sig = SIGUSR2) {
+    nanosPerCycle();
+    return SignalDump::on(sig, [] { dump(std::cerr); });
+  }
+};
+
+struct HookTimer {
+  HookStats &stats;
+  uint64_t start;
+  HookTimer(HookStats &stats) : stats(stats), start(__rdtsc()) {}
+  ~HookTimer() { stats.record(__rdtsc() - start); }
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Mod-side counterpart of the server's SmallSet<T> (a std::vector scanned linearly). The first N elements live inside
+// the object, so small sets never allocate, and the storage moves to the heap only past that.
+//
+// Unsorted sets append on insert and swap the last element into the hole on erase; find() on 8-byte pointers and
+// integers compares two elements per SSE2 instruction. Sorted sets keep elements ordered by std::less and
+// find() is a branchless binary search, which wins once sets grow past a few dozen elements.
+template <typename T, std::size_t N = 8, bool Sorted = false> struct InlineSmallSet {
+  static_assert(N > 0, "InlineSmallSet needs at least one inline slot");
+  using iterator       = T *;
+  using const_iterator = T const *;
+
+  alignas(T) unsigned char inlineStorage[sizeof(T) * N];
+  T *ptr               = reinterpret_cast<T *>(inlineStorage);
+  std::size_t count    = 0;
+  std::size_t capacity = N;
+
+  InlineSmallSet() {}
+  InlineSmallSet(InlineSmallSet const &other) {
+    reserve(other.count);
+    std::uninitialized_copy(other.begin(), other.end(), ptr);
+    count = other.count;
+  }
+  InlineSmallSet(InlineSmallSet &&other) noexcept(std::is_nothrow_move_constructible<T>::value) { take(other); }
+  InlineSmallSet &operator=(InlineSmallSet const &other) {
+    if (this != &other) {
+      clear();
+      reserve(other.count);
+      std::uninitialized_copy(other.begin(), other.end(), ptr);
+      count = other.count;
+    }
+    return *this;
+  }
+  InlineSmallSet &operator=(InlineSmallSet &&other) noexcept(std::is_nothrow_move_constructible<T>::value) {
+    if (this != &other) {
+      clear();
+      release();
+      take(other);
+    }
+    return *this;
+  }
+  ~InlineSmallSet() {
+    clear();
+    release();
+  }
+
+  iterator begin() { return ptr; }
+  iterator end() { return ptr + count; }
+  const_iterator begin() const { return ptr; }
+  const_iterator end() const { return ptr + count; }
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool isInline() const { return ptr == reinterpret_cast<T const *>(inlineStorage); }
+  T &operator[](std::size_t index) { return ptr[index]; }
+  T const &operator[](std::size_t index) const { return ptr[index]; }
+
+  void clear() {
+    std::destroy(begin(), end());
+    count = 0;
+  }
+
+  void reserve(std::size_t wanted) {
+    if (wanted <= capacity) return;
+    auto grown = std::max(wanted, capacity * 2);
+    auto fresh = static_cast<T *>(::operator new(sizeof(T) * grown, std::align_val_t{ alignof(T) }));
+    std::uninitialized_move(begin(), end(), fresh);
+    std::destroy(begin(), end());
+    release();
+    ptr      = fresh;
+    capacity = grown;
+  }
+
+  // Returns false, leaving the set untouched, if an equal element is already present.
+  template <typename U> bool emplace(U &&value) {
+    if constexpr (Sorted) {
+      auto pos = lowerBound(value);
+      if (pos != end() && !std::less<T>{}(value, *pos)) return false;
+      auto index = pos - begin();
+      reserve(count + 1);
+      pos = begin() + index;
+      if (pos == end())
+        new (end()) T(std::forward<U>(value));
+      else {
+        new (end()) T(std::move(end()[-1]));
+        std::move_backward(pos, end() - 1, end());
+        *pos = T(std::forward<U>(value));
+      }
+    } else {
+      if (find(value) != end()) return false;
+      reserve(count + 1);
+      new (end()) T(std::forward<U>(value));
+    }
+    count++;
+    return true;
+  }
+
+  iterator find(T const &value) {
+    if constexpr (Sorted) {
+      auto pos = lowerBound(value);
+      return pos != end() && !std::less<T>{}(value, *pos) ? pos : end();
+    } else
+      return begin() + scan(value);
+  }
+  const_iterator find(T const &value) const { return const_cast<InlineSmallSet *>(this)->find(value); }
+  bool contains(T const &value) const { return find(value) != end(); }
+
+  bool erase(T const &value) {
+    auto pos = find(value);
+    if (pos == end()) return false;
+    erase(pos);
+    return true;
+  }
+
+  // Sorted sets keep their order; unsorted ones move the last element into the erased slot.
+  iterator erase(const_iterator it) {
+    auto pos = begin() + (it - begin());
+    if constexpr (Sorted)
+      std::move(pos + 1, end(), pos);
+    else if (pos != end() - 1)
+      *pos = std::move(end()[-1]);
+    end()[-1].~T();
+    count--;
+    return pos;
+  }
+
+private:
+  void release() {
+    if (!isInline()) ::operator delete(ptr, std::align_val_t{ alignof(T) });
+    ptr      = reinterpret_cast<T *>(inlineStorage);
+    capacity = N;
+  }
+
+  void take(InlineSmallSet &other) {
+    if (other.isInline()) {
+      std::uninitialized_move(other.begin(), other.end(), ptr);
+      count = other.count;
+      other.clear();
+    } else {
+      ptr            = other.ptr;
+      count          = other.count;
+      capacity       = other.capacity;
+      other.ptr      = reinterpret_cast<T *>(other.inlineStorage);
+      other.count    = 0;
+      other.capacity = N;
+    }
+  }
+
+  // The loop only narrows the range by a data-dependent offset, which compiles to a conditional move.
+  iterator lowerBound(T const &value) {
+    T *base = begin();
+    auto n  = count;
+    if (!n) return base;
+    while (n > 1) {
+      auto half = n / 2;
+      base += std::less<T>{}(base[half], value) ? half : 0;
+      n -= half;
+    }
+    return base + std::less<T>{}(*base, value);
+  }
+
+  std::size_t scan(T const &value) const {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    if constexpr (sizeof(T) == 8 && (std::is_pointer<T>::value || std::is_integral<T>::value)) {
+      std::int64_t bits;
+      std::memcpy(&bits, &value, 8);
+      auto needle = _mm_set1_epi64x(bits);
+      for (; i + 2 <= count; i += 2) {
+        // SSE2 has no 64-bit compare: both 32-bit halves of a lane must match.
+        auto eq   = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(ptr + i)), needle);
+        eq        = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        auto mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    for (; i < count; i++)
+      if (ptr[i] == value) break;
+    return i;
+  }
+};
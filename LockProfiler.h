@@ -0,0 +1,237 @@
+#pragma once
+
+#include <HookStats.h>
+#include <StaticHook.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <ostream>
+#include <pthread.h>
+#include <vector>
+#include <x86intrin.h>
+
+// Opt-in contention profiler for the server's std::mutex members (DBStorage::mtx352/mtx568, InMemoryFileStorage::mtx,
+// ThreadLocal::mtx, ...) and std::shared_mutex members. install() hooks pthread_mutex_lock, pthread_mutex_timedlock,
+// pthread_rwlock_rdlock and pthread_rwlock_wrlock: an uncontended lock costs one extra trylock, and a lock that has to
+// wait is timed with the TSC and charged to its (lock, call site) pair in a fixed lock-free table, so the hook itself
+// never allocates or locks. The timed rwlock variants and spinlocks are not covered.
+//
+// Mutexes are named by registering the objects that own them, e.g. watch("DBStorage", storage, sizeof(DBStorage)); the
+// report then shows "DBStorage+352" instead of a bare address. dump() and dumpOnSignal() print every contended pair by
+// total wait time with a log2 histogram of individual waits, and can be called at any time while the server runs.
+struct LockProfiler {
+  static constexpr std::size_t tableSize = 4096; // power of two
+  static constexpr std::size_t buckets   = 20;
+  static constexpr std::size_t maxWatch  = 64;
+  // Waits shorter than 2^firstBucketBits cycles share the first bucket; each further bucket doubles the bound.
+  static constexpr unsigned firstBucketBits = 10;
+
+  struct Entry {
+    std::atomic<uintptr_t> mutex{ 0 };
+    std::atomic<uintptr_t> caller{ 0 };
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> cycles{ 0 };
+    std::atomic<uint64_t> maxCycles{ 0 };
+    std::atomic<uint64_t> histogram[buckets]{};
+  };
+  struct Watch {
+    const char *name;
+    uintptr_t begin, end;
+    std::atomic<bool> live{ false };
+  };
+
+  // A hooked lock function and the try variant it is attempted with first.
+  struct Hook {
+    const char *lock, *attempt;
+    void *replacement;
+    void *original = nullptr;
+    int (*tryLock)(void *) = nullptr;
+  };
+
+  Entry table[tableSize];
+  Watch watches[maxWatch];
+  std::atomic<std::size_t> watchCount{ 0 };
+  std::atomic<uint64_t> dropped{ 0 };
+  std::atomic<bool> enabled{ true };
+  Hook hooks[4] = {
+    { "pthread_mutex_lock", "pthread_mutex_trylock", (void *)&timed<0, pthread_mutex_t> },
+    { "pthread_mutex_timedlock", "pthread_mutex_trylock", (void *)&timed<1, pthread_mutex_t, timespec const *> },
+    { "pthread_rwlock_rdlock", "pthread_rwlock_tryrdlock", (void *)&timed<2, pthread_rwlock_t> },
+    { "pthread_rwlock_wrlock", "pthread_rwlock_trywrlock", (void *)&timed<3, pthread_rwlock_t> },
+  };
+
+  static LockProfiler &get() {
+    static LockProfiler profiler;
+    return profiler;
+  }
+
+  // Hooks the lock functions for the whole process. Call once, as early as possible; there is no uninstall, use
+  // `enabled` to pause recording instead. Returns whether pthread_mutex_lock itself was hooked; the others are best
+  // effort.
+  bool install() {
+    HookStats::clockBase();
+    for (auto &hook : hooks) {
+      if (hook.original) continue;
+      auto attempt = dlsym(RTLD_DEFAULT, hook.attempt);
+      auto target  = dlsym(RTLD_DEFAULT, hook.lock);
+      if (!attempt || !target) continue;
+      hook.tryLock = (int (*)(void *))attempt;
+      MSHookFunction(target, hook.replacement, &hook.original);
+    }
+    return hooks[0].original != nullptr;
+  }
+
+  // Attributes mutexes inside [object, object + size) to `name`. `name` must outlive the profiler.
+  bool watch(const char *name, void const *object, std::size_t size) {
+    auto index = watchCount.fetch_add(1, std::memory_order_relaxed);
+    if (index >= maxWatch) {
+      watchCount.store(maxWatch, std::memory_order_relaxed);
+      return false;
+    }
+    auto &slot = watches[index];
+    slot.name  = name;
+    slot.begin = (uintptr_t)object;
+    slot.end   = (uintptr_t)object + size;
+    slot.live.store(true, std::memory_order_release);
+    return true;
+  }
+
+  void unwatch(void const *object) {
+    for (std::size_t i = 0, n = std::min(watchCount.load(std::memory_order_relaxed), maxWatch); i < n; i++)
+      if (watches[i].begin == (uintptr_t)object) watches[i].live.store(false, std::memory_order_relaxed);
+  }
+
+  void reset() {
+    for (auto &entry : table) {
+      entry.count.store(0, std::memory_order_relaxed);
+      entry.cycles.store(0, std::memory_order_relaxed);
+      entry.maxCycles.store(0, std::memory_order_relaxed);
+      for (auto &bucket : entry.histogram) bucket.store(0, std::memory_order_relaxed);
+    }
+    dropped.store(0, std::memory_order_relaxed);
+  }
+
+  // Prints contended (mutex, call site) pairs by total wait. Call sites are symbolized with dladdr.
+  void dump(std::ostream &os) {
+    Guard guard;
+    auto scale = HookStats::nanosPerCycle();
+    char line[256];
+    for (auto entry : sorted()) {
+      auto count = entry->count.load(std::memory_order_relaxed);
+      auto total = entry->cycles.load(std::memory_order_relaxed) * scale;
+      os << describe(entry, line, sizeof(line));
+      Dl_info info;
+      auto caller = entry->caller.load(std::memory_order_relaxed);
+      if (dladdr((void *)caller, &info) && info.dli_sname)
+        os << " at " << info.dli_sname << "+0x" << std::hex << caller - (uintptr_t)info.dli_saddr << std::dec;
+      else
+        os << " at server+0x" << std::hex << caller - StaticHookRegistry::cache().base << std::dec;
+      os << ": " << count << " waits, " << total / 1e6 << "ms total, " << entry->maxCycles.load(std::memory_order_relaxed) * scale / 1e3 << "us max\n";
+      writeHistogram(entry, scale, line, sizeof(line));
+      os << line << '\n';
+    }
+    if (auto lost = dropped.load(std::memory_order_relaxed)) os << lost << " waits dropped (table full)\n";
+    os.flush();
+  }
+
+  // Dumps to stderr whenever the signal is raised, from a SignalDump thread.
+  static bool dumpOnSignal(int sig = SIGUSR1) {
+    HookStats::nanosPerCycle();
+    return SignalDump::on(sig, [] { get().dump(std::cerr); });
+  }
+
+private:
+  // Set while the profiler itself runs, so locks taken by dump() are not recorded.
+  struct Guard {
+    static bool &active() {
+      // global-dynamic, so a mod that is dlopen()ed late can still get TLS for it.
+      static thread_local bool flag __attribute__((tls_model("global-dynamic"))) = false;
+      return flag;
+    }
+    bool outer = !active();
+    Guard() { active() = true; }
+    ~Guard() {
+      if (outer) active() = false;
+    }
+  };
+
+  template <std::size_t I, typename Lock, typename... Rest> static int timed(Lock *lock, Rest... rest) {
+    auto &self     = get();
+    auto &hook     = self.hooks[I];
+    auto original  = (int (*)(Lock *, Rest...))hook.original;
+    if (__builtin_expect(hook.tryLock(lock) == 0, 1)) return 0;
+    if (!self.enabled.load(std::memory_order_relaxed) || Guard::active()) return original(lock, rest...);
+    auto caller = (uintptr_t)__builtin_return_address(0);
+    auto start  = __rdtsc();
+    int result  = original(lock, rest...);
+    self.record((uintptr_t)lock, caller, __rdtsc() - start);
+    return result;
+  }
+
+  void record(uintptr_t mutex, uintptr_t caller, uint64_t cycles) {
+    auto hash = (mutex ^ (caller * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    for (std::size_t probe = 0; probe < 64; probe++) {
+      auto &entry = table[((hash >> 40) + probe) & (tableSize - 1)];
+      auto key    = entry.mutex.load(std::memory_order_acquire);
+      if (key == 0) {
+        if (entry.mutex.compare_exchange_strong(key, mutex, std::memory_order_acq_rel)) {
+          entry.caller.store(caller, std::memory_order_release);
+          key = mutex;
+        }
+      }
+      if (key != mutex) continue;
+      // A slot just claimed by another thread publishes its caller right after the CAS.
+      uintptr_t owner;
+      while (!(owner = entry.caller.load(std::memory_order_acquire))) _mm_pause();
+      if (owner != caller) continue;
+
+      entry.count.fetch_add(1, std::memory_order_relaxed);
+      entry.cycles.fetch_add(cycles, std::memory_order_relaxed);
+      auto max = entry.maxCycles.load(std::memory_order_relaxed);
+      while (cycles > max && !entry.maxCycles.compare_exchange_weak(max, cycles, std::memory_order_relaxed)) {}
+      unsigned bits = cycles ? 64 - __builtin_clzll(cycles) : 0;
+      entry.histogram[std::min<std::size_t>(bits > firstBucketBits ? bits - firstBucketBits : 0, buckets - 1)].fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::vector<Entry *> sorted() {
+    std::vector<Entry *> list;
+    for (auto &entry : table)
+      if (entry.count.load(std::memory_order_relaxed)) list.push_back(&entry);
+    std::sort(list.begin(), list.end(), [](Entry *a, Entry *b) { return a->cycles.load(std::memory_order_relaxed) > b->cycles.load(std::memory_order_relaxed); });
+    return list;
+  }
+
+  char const *describe(Entry *entry, char *buffer, std::size_t size) {
+    auto mutex = entry->mutex.load(std::memory_order_relaxed);
+    for (std::size_t i = 0, n = std::min(watchCount.load(std::memory_order_relaxed), maxWatch); i < n; i++) {
+      auto &slot = watches[i];
+      if (slot.live.load(std::memory_order_acquire) && mutex >= slot.begin && mutex < slot.end) {
+        snprintf(buffer, size, "%s+%lu", slot.name, (unsigned long)(mutex - slot.begin));
+        return buffer;
+      }
+    }
+    snprintf(buffer, size, "lock@%p", (void *)mutex);
+    return buffer;
+  }
+
+  // "<Nus:count ..." for every non-empty bucket, upper bounds converted from cycles.
+  static void writeHistogram(Entry *entry, double scale, char *buffer, std::size_t size) {
+    std::size_t used = 0;
+    buffer[0]        = 0;
+    for (std::size_t i = 0; i < buckets && used < size; i++) {
+      auto hits = entry->histogram[i].load(std::memory_order_relaxed);
+      if (!hits) continue;
+      auto bound = (double)(1ull << (firstBucketBits + i)) * scale / 1e3;
+      int len    = i == buckets - 1 ? snprintf(buffer + used, size - used, " >=%.0fus:%llu", bound / 2, (unsigned long long)hits)
+                                    : snprintf(buffer + used, size - used, " <%.1fus:%llu", bound, (unsigned long long)hits);
+      if (len <= 0) break;
+      used += len;
+    }
+  }
+};
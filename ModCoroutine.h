@@ -0,0 +1,164 @@
+#pragma once
+
+#include "minecraft/types.h"
+#include <TaskPool.h>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+// Fire-and-forget C++20 coroutine for long-running mod jobs. The body runs on the server thread until its first co_await
+// and can then spread over as many ticks as it needs:
+//
+//   ModTask fill(...) {
+//     for (auto &pos : positions) {
+//       co_await chunkLoaded(ChunkPos{ pos });
+//       setBlock(pos);
+//       co_await checkpoint(); // yields to the next tick only once this tick's budget is used up
+//     }
+//   }
+//
+// Suspended tasks are resumed by CoroutineRunner::run(budget), which the mod calls from its hook on
+// Scheduler::processCoroutines with the same duration the server gives its own coroutines.
+struct ModTask {
+  struct promise_type {
+    ModTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+struct CoroutineRunner {
+  using clock = std::chrono::steady_clock;
+  // Coordinates are kept as plain ints: ChunkPos declares a copy assignment, so copying one warns under
+  // -Wdeprecated-copy.
+  struct Waiter {
+    int x, z;
+    std::coroutine_handle<> handle;
+  };
+
+  std::deque<std::coroutine_handle<>> ready;
+  std::vector<Waiter> waiting;
+  std::mutex inboxMtx;
+  std::vector<std::coroutine_handle<>> inbox;
+  clock::time_point deadline{};
+  // Set by the mod to whatever chunk source it has access to; while it is unset every chunk counts as loaded.
+  bool (*chunkQuery)(ChunkPos const &) = nullptr;
+
+  static CoroutineRunner &get() {
+    static CoroutineRunner runner;
+    return runner;
+  }
+
+  // Queues a handle from any thread; it is resumed on the server thread during the next run().
+  void post(std::coroutine_handle<> handle) {
+    std::lock_guard lock{ inboxMtx };
+    inbox.push_back(handle);
+  }
+
+  // Queues a handle for the next run(). Inside run() it goes straight onto the ready queue; from anywhere else, pool
+  // workers included, it goes through post().
+  void schedule(std::coroutine_handle<> handle) {
+    if (running())
+      ready.push_back(handle);
+    else
+      post(handle);
+  }
+
+  // True only on the server thread while run() is resuming tasks, so schedule() and overBudget() never touch ready or
+  // deadline from another thread.
+  static bool &running() {
+    thread_local bool flag = false;
+    return flag;
+  }
+
+  bool overBudget() const { return !running() || clock::now() >= deadline; }
+
+  std::size_t backlog() const { return ready.size() + waiting.size(); }
+
+  // Resumes queued tasks until the budget runs out. Anything queued while running waits for the next call.
+  void run(std::chrono::nanoseconds budget) {
+    deadline = clock::now() + budget;
+    {
+      std::lock_guard lock{ inboxMtx };
+      ready.insert(ready.end(), inbox.begin(), inbox.end());
+      inbox.clear();
+    }
+    auto it = waiting.begin();
+    for (auto &waiter : waiting)
+      if (chunkQuery && !chunkQuery(ChunkPos{ waiter.x, waiter.z }))
+        *it++ = waiter;
+      else
+        ready.push_back(waiter.handle);
+    waiting.erase(it, waiting.end());
+
+    running() = true;
+    for (auto count = ready.size(); count && !overBudget(); count--) {
+      auto handle = ready.front();
+      ready.pop_front();
+      handle.resume();
+    }
+    running() = false;
+    deadline = {};
+  }
+};
+
+// Suspends until the next CoroutineRunner::run(). Safe to await from any thread.
+inline auto nextTick() {
+  struct Awaiter {
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { CoroutineRunner::get().schedule(handle); }
+    void await_resume() {}
+  };
+  return Awaiter{};
+}
+
+// Suspends only when the current tick's budget is spent, so tight loops can yield cheaply on every iteration. Outside
+// run(), e.g. after offThread(), there is no budget to spend and it always moves the task to the next run().
+inline auto checkpoint() {
+  struct Awaiter {
+    bool await_ready() { return !CoroutineRunner::get().overBudget(); }
+    void await_suspend(std::coroutine_handle<> handle) { CoroutineRunner::get().schedule(handle); }
+    void await_resume() {}
+  };
+  return Awaiter{};
+}
+
+// Continues on a TaskPool worker. Use mainThread() to come back before touching level state.
+inline auto offThread(TaskPool &pool = TaskPool::get()) {
+  struct Awaiter {
+    TaskPool &pool;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { pool.submit([handle] { handle.resume(); }); }
+    void await_resume() {}
+  };
+  return Awaiter{ pool };
+}
+
+// Continues on the server thread during the next CoroutineRunner::run(). Safe to await from any thread.
+inline auto mainThread() {
+  struct Awaiter {
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { CoroutineRunner::get().post(handle); }
+    void await_resume() {}
+  };
+  return Awaiter{};
+}
+
+// Suspends until CoroutineRunner::chunkQuery reports the chunk as loaded. Must be awaited on the server thread.
+inline auto chunkLoaded(ChunkPos const &pos) {
+  struct Awaiter {
+    int x, z;
+    bool await_ready() {
+      auto query = CoroutineRunner::get().chunkQuery;
+      return !query || query(ChunkPos{ x, z });
+    }
+    void await_suspend(std::coroutine_handle<> handle) { CoroutineRunner::get().waiting.push_back({ x, z, handle }); }
+    void await_resume() {}
+  };
+  return Awaiter{ pos.x, pos.z };
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "minecraft/LevelStorage.h"
+#include <HookChain.h>
+#include <StaticHook.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// leveldb::DecompressAllocator without the lock on every block read. Released buffers are filed by capacity into
+// power-of-two size classes. Each thread first uses its own free lists, which take no lock. Only when a thread's list
+// for a class is empty, or full on release, does it touch a shared overflow pool, and that pool keeps a bounded number
+// of buffers per class.
+//
+// get() has no size argument, so each thread remembers the size of the last block it released. A new get() prefers a
+// buffer at least that large, and a fresh buffer is reserved to the next power of two. Decompressing into the buffer
+// then never reallocates.
+//
+// prune() drops the shared pool at once. Each thread drops its own lists the next time it calls get() or release(),
+// and a thread that exits frees its lists then.
+//
+// install() makes the server's own allocator forward here. The DB keeps a pointer to that allocator, so it cannot be
+// replaced after construction. install() also prunes on DBStorage::freeCaches().
+struct PooledDecompressAllocator : leveldb::DecompressAllocator {
+  static constexpr unsigned minBits     = 10; // smaller buffers are not worth pooling
+  static constexpr unsigned maxBits     = 22; // nor are larger ones kept around
+  static constexpr unsigned classes     = maxBits - minBits + 1;
+  static constexpr unsigned threadDepth = 4;
+  static constexpr unsigned sharedDepth = 16;
+
+  struct ThreadCache {
+    std::uint64_t owner = 0, generation = 0;
+    unsigned hint       = 0; // class of the last block released on this thread
+    unsigned count[classes]{};
+    std::string buffers[classes][threadDepth];
+
+    void clear() {
+      for (unsigned k = 0; k < classes; k++)
+        while (count[k]) std::string{}.swap(buffers[k][--count[k]]);
+    }
+  };
+
+  std::uint64_t const id = nextId().fetch_add(1, std::memory_order_relaxed);
+  std::atomic<std::uint64_t> generation{ 0 };
+  std::mutex poolMutex;
+  std::vector<std::string> pool[classes];
+  // The server's versions, kept only because the hook needs somewhere to store them; the forwarders replace them.
+  inline static void *originalGet, *originalRelease, *originalPrune;
+
+  // Named apart from get(), which is the allocator's own entry point.
+  static PooledDecompressAllocator &instance() {
+    static PooledDecompressAllocator allocator;
+    return allocator;
+  }
+
+  std::string get() override {
+    auto &cache = local();
+    for (unsigned k = cache.hint; k < classes; k++)
+      if (cache.count[k]) return std::move(cache.buffers[k][--cache.count[k]]);
+    {
+      std::lock_guard lock(poolMutex);
+      for (unsigned k = cache.hint; k < classes; k++)
+        if (!pool[k].empty()) {
+          auto buffer = std::move(pool[k].back());
+          pool[k].pop_back();
+          return buffer;
+        }
+    }
+    std::string buffer;
+    buffer.reserve(std::size_t(1) << (cache.hint + minBits));
+    return buffer;
+  }
+
+  void release(std::string &&string) override {
+    auto &cache = local();
+    cache.hint  = classOf(string.size() ? (string.size() - 1) * 2 : 0); // rounds up
+    if (string.capacity() < (std::size_t(1) << minBits) || string.capacity() >= (std::size_t(2) << maxBits)) return;
+    string.clear();
+    auto k = classOf(string.capacity());
+    if (cache.count[k] < threadDepth) {
+      cache.buffers[k][cache.count[k]++] = std::move(string);
+      return;
+    }
+    std::lock_guard lock(poolMutex);
+    if (pool[k].size() < sharedDepth) pool[k].push_back(std::move(string));
+  }
+
+  void prune() override {
+    generation.fetch_add(1, std::memory_order_release);
+    std::lock_guard lock(poolMutex);
+    for (auto &list : pool) std::vector<std::string>{}.swap(list);
+  }
+
+  using FreeCachesChain = THookChainFor(_ZN9DBStorage10freeCachesEv, void(DBStorage *));
+
+  // Routes the server's DecompressAllocator, used by DBStorage::db_decompress_allocator, to instance(). Call before the
+  // level loads.
+  static void install() {
+    auto &registry = StaticHookRegistry::get();
+    registry.add("_ZN7leveldb19DecompressAllocator3getB5cxx11Ev", (void *)&forwardGet, &originalGet);
+    registry.add("_ZN7leveldb19DecompressAllocator7releaseEONSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEE", (void *)&forwardRelease, &originalRelease);
+    registry.add("_ZN7leveldb19DecompressAllocator5pruneEv", (void *)&forwardPrune, &originalPrune);
+    void (*prune)(std::nullptr_t, DBStorage *&) = [](std::nullptr_t, DBStorage *&) { instance().prune(); };
+    FreeCachesChain::get().add("_ZN9DBStorage10freeCachesEv", true, false, 0, (void *)prune);
+  }
+
+private:
+  static std::atomic<std::uint64_t> &nextId() {
+    static std::atomic<std::uint64_t> id{ 1 };
+    return id;
+  }
+
+  static unsigned classOf(std::size_t size) {
+    unsigned bits = size ? 63 - __builtin_clzll(size) : 0;
+    return bits < minBits ? 0 : bits > maxBits ? classes - 1 : bits - minBits;
+  }
+
+  // A thread's lists belong to one allocator at a time and are dropped when another one, or a prune(), comes along.
+  ThreadCache &local() {
+    static thread_local ThreadCache cache;
+    auto current = generation.load(std::memory_order_acquire);
+    if (cache.owner != id || cache.generation != current) {
+      cache.clear();
+      cache.owner      = id;
+      cache.generation = current;
+    }
+    return cache;
+  }
+
+  static std::string forwardGet(leveldb::DecompressAllocator *) { return instance().get(); }
+  static void forwardRelease(leveldb::DecompressAllocator *, std::string &&string) { instance().release(std::move(string)); }
+  static void forwardPrune(leveldb::DecompressAllocator *) { instance().prune(); }
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "minecraft/Scheduler.h"
+#include <HookChain.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Frame-time telemetry for the server's Scheduler. Every series keeps its last `Ring::capacity` samples in a lock-free
+// ring, so recording costs one fetch_add and one store from any thread, and stats() computes percentiles over that
+// window on demand.
+//
+// install() times Scheduler::processCoroutines and frees a group's slot on Scheduler::unregisterTaskGroup. TaskGroup's
+// own entry points are not declared here, so the mod wraps the work it cares about in group(), naming the groups once
+// they exist:
+//
+//   telemetry.nameGroup(level->level_tasks.get(), "Level::level_tasks");
+//   telemetry.nameGroup(level->level_io.get(), "Level::level_io");
+//   telemetry.nameGroup(storage->task_group.get(), "DBStorage::task_group");
+//
+// Groups that were never named still get a series of their own, reported by address.
+struct SchedulerTelemetry {
+  using clock = std::chrono::steady_clock;
+
+  struct Ring {
+    static constexpr std::size_t capacity = 2048; // power of two
+    std::atomic<std::uint64_t> head{ 0 };
+    std::atomic<std::uint64_t> samples[capacity]{};
+
+    void push(std::uint64_t nanos) { samples[head.fetch_add(1, std::memory_order_relaxed) & (capacity - 1)].store(std::max<std::uint64_t>(nanos, 1), std::memory_order_relaxed); }
+  };
+
+  struct Stats {
+    std::uint64_t total = 0; // samples ever recorded
+    std::size_t window  = 0; // samples the percentiles are taken over
+    double mean = 0, p50 = 0, p99 = 0, max = 0; // milliseconds
+  };
+
+  struct Group {
+    std::atomic<TaskGroup *> group{ nullptr };
+    std::atomic<const char *> name{ nullptr };
+    Ring ring;
+  };
+
+  static constexpr std::size_t maxGroups = 32;
+
+  Ring frames;     // start of one processCoroutines call to the next
+  Ring coroutines; // time spent inside processCoroutines
+  Group groups[maxGroups];
+  std::atomic<std::uint64_t> starvedFrames{ 0 };
+  std::atomic<unsigned> targetFPS{ 0 };
+  std::atomic<std::uint64_t> untracked{ 0 };
+  clock::time_point lastFrame{};
+  clock::time_point frameStarted{};
+
+  static SchedulerTelemetry &get() {
+    static SchedulerTelemetry telemetry;
+    return telemetry;
+  }
+
+  // Records when it goes out of scope, so it has to be kept: `auto scope = telemetry.frame(s);`
+  template <typename Fn> struct [[nodiscard]] Scope {
+    Fn done;
+    clock::time_point started = clock::now();
+    ~Scope() { done(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - started).count()); }
+  };
+
+  // Times one Scheduler::processCoroutines call; server thread only. install() does this already.
+  auto frame(Scheduler &scheduler) { return Scope<CoroutineFn>{ CoroutineFn{ this }, beginFrame(scheduler) }; }
+
+  // Times work done on behalf of a TaskGroup; safe from any thread.
+  auto group(TaskGroup *group) {
+    auto slot = find(group, true);
+    return Scope<GroupFn>{ GroupFn{ slot, this } };
+  }
+
+  void nameGroup(TaskGroup *group, const char *name) {
+    if (auto slot = find(group, true)) slot->name.store(name, std::memory_order_relaxed);
+  }
+
+  // Frees the group's slot for reuse. A scope still open on the group may land one sample in the slot's next owner.
+  void releaseGroup(TaskGroup *group) {
+    auto slot = find(group, false);
+    if (!slot) return;
+    slot->name.store(nullptr, std::memory_order_relaxed);
+    slot->ring.head.store(0, std::memory_order_relaxed);
+    for (auto &sample : slot->ring.samples) sample.store(0, std::memory_order_relaxed);
+    slot->group.store(nullptr, std::memory_order_release);
+  }
+
+  using ProcessCoroutinesChain   = THookChainFor(_ZN9Scheduler17processCoroutinesENSt6chrono8durationIlSt5ratioILl1ELl1000000000EEEE, void(Scheduler *, std::chrono::nanoseconds));
+  using UnregisterTaskGroupChain = THookChainFor(_ZN9Scheduler19unregisterTaskGroupER9TaskGroup, void(Scheduler *, TaskGroup *));
+
+  // Call before the level loads.
+  static void install() {
+    void (*begin)(Scheduler *&, std::chrono::nanoseconds &) = [](Scheduler *&scheduler, std::chrono::nanoseconds &) { get().beginFrame(*scheduler); };
+    void (*end)(std::nullptr_t, Scheduler *&, std::chrono::nanoseconds &) = [](std::nullptr_t, Scheduler *&, std::chrono::nanoseconds &) {
+      auto &self = get();
+      self.coroutines.push(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - self.frameStarted).count());
+    };
+    void (*release)(Scheduler *&, TaskGroup *&) = [](Scheduler *&, TaskGroup *&group) { get().releaseGroup(group); };
+    ProcessCoroutinesChain::get().add("_ZN9Scheduler17processCoroutinesENSt6chrono8durationIlSt5ratioILl1ELl1000000000EEEE", false, false, 0, (void *)begin);
+    ProcessCoroutinesChain::get().add("_ZN9Scheduler17processCoroutinesENSt6chrono8durationIlSt5ratioILl1ELl1000000000EEEE", true, false, 0, (void *)end);
+    UnregisterTaskGroupChain::get().add("_ZN9Scheduler19unregisterTaskGroupER9TaskGroup", false, false, 0, (void *)release);
+  }
+
+  static Stats stats(Ring const &ring) {
+    Stats result;
+    result.total = ring.head.load(std::memory_order_relaxed);
+    std::vector<std::uint64_t> window;
+    window.reserve(Ring::capacity);
+    for (auto &sample : ring.samples)
+      if (auto nanos = sample.load(std::memory_order_relaxed)) window.push_back(nanos);
+    result.window = window.size();
+    if (window.empty()) return result;
+    std::uint64_t sum = 0;
+    for (auto nanos : window) sum += nanos;
+    result.mean = sum / 1e6 / window.size();
+    auto at     = [&](double q) {
+      auto it = window.begin() + std::min<std::size_t>(window.size() - 1, (std::size_t)(q * window.size()));
+      std::nth_element(window.begin(), it, window.end());
+      return *it / 1e6;
+    };
+    result.p50 = at(0.5);
+    result.p99 = at(0.99);
+    result.max = *std::max_element(window.begin(), window.end()) / 1e6;
+    return result;
+  }
+
+  Stats frameStats() const { return stats(frames); }
+  Stats coroutineStats() const { return stats(coroutines); }
+  Stats groupStats(TaskGroup *group) {
+    auto slot = find(group, false);
+    return slot ? stats(slot->ring) : Stats{};
+  }
+
+  void dump(std::ostream &os) {
+    auto line = [&](const char *name, void const *id, Stats const &s) {
+      if (!s.window) return;
+      os << name;
+      if (id) os << '@' << id;
+      os << ": " << s.total << " samples, mean " << s.mean << "ms, p50 " << s.p50 << "ms, p99 " << s.p99 << "ms, max " << s.max << "ms\n";
+    };
+    os << "target fps " << targetFPS.load(std::memory_order_relaxed) << ", " << starvedFrames.load(std::memory_order_relaxed) << " starved frames\n";
+    line("frame", nullptr, frameStats());
+    line("processCoroutines", nullptr, coroutineStats());
+    for (auto &slot : groups)
+      if (auto group = slot.group.load(std::memory_order_acquire)) {
+        auto name = slot.name.load(std::memory_order_relaxed);
+        line(name ? name : "TaskGroup", name ? nullptr : group, stats(slot.ring));
+      }
+    if (auto lost = untracked.load(std::memory_order_relaxed)) os << lost << " samples from groups beyond the first " << maxGroups << '\n';
+    os.flush();
+  }
+
+private:
+  clock::time_point beginFrame(Scheduler &scheduler) {
+    auto now = clock::now();
+    if (lastFrame != clock::time_point{}) frames.push(std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastFrame).count());
+    lastFrame = frameStarted = now;
+    if (scheduler.isStarved()) starvedFrames.fetch_add(1, std::memory_order_relaxed);
+    targetFPS.store(scheduler.getEffectiveTargetFPS(), std::memory_order_relaxed);
+    return now;
+  }
+
+  struct CoroutineFn {
+    SchedulerTelemetry *self;
+    void operator()(std::uint64_t nanos) const { self->coroutines.push(nanos); }
+  };
+  struct GroupFn {
+    Group *slot;
+    SchedulerTelemetry *self;
+    void operator()(std::uint64_t nanos) const {
+      if (slot)
+        slot->ring.push(nanos);
+      else
+        self->untracked.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+  // Slots are claimed with a CAS and released by releaseGroup(), so lookups need no lock. Released slots leave holes,
+  // so a group is looked for in every slot before the first free one is claimed.
+  Group *find(TaskGroup *group, bool claim) {
+    if (!group) return nullptr;
+    for (auto &slot : groups)
+      if (slot.group.load(std::memory_order_acquire) == group) return &slot;
+    if (!claim) return nullptr;
+    for (auto &slot : groups) {
+      TaskGroup *current = nullptr;
+      if (slot.group.compare_exchange_strong(current, group, std::memory_order_acq_rel) || current == group) return &slot;
+    }
+    return nullptr;
+  }
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "minecraft/ServiceLocator.h"
+#include <HookChain.h>
+#include <atomic>
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+
+// Cached ServiceLocator<T> lookups for hot paths. The first get() calls into the server and every later one is a plain
+// pointer load; the cache is only dropped when the server installs a new default, which watch() detects with a post
+// hook on that instantiation's setDefault. The chain is declared at namespace scope, so every mod watching the same
+// service shares its trampoline:
+//
+//   using AppPlatformDefault = THookChainFor(_ZN14ServiceLocatorI11AppPlatformE10setDefaultERS0_, void(AppPlatform *));
+//   ServiceHandle<AppPlatform>::watch(AppPlatformDefault::get(), "_ZN14ServiceLocatorI11AppPlatformE10setDefaultERS0_");
+//   auto &platform = ServiceHandle<AppPlatform>::get();
+template <typename T> struct ServiceHandle {
+  inline static std::atomic<T *> cached{ nullptr };
+
+  static T &get() {
+    auto service = cached.load(std::memory_order_acquire);
+    if (__builtin_expect(service == nullptr, 0)) service = refresh();
+    return *service;
+  }
+
+  static T *refresh() {
+    auto service = &ServiceLocator<T>::get();
+    cached.store(service, std::memory_order_release);
+    return service;
+  }
+
+  static void invalidate() { cached.store(nullptr, std::memory_order_release); }
+
+  // Adds a post callback on ServiceLocator<T>::setDefault(T &) to the chain THookChainFor builds for its mangled name.
+  template <typename Tag> static void watch(HookChain<Tag, void(T *)> &chain, const char *setDefaultSym) {
+    void (*fn)(std::nullptr_t, T *&) = [](std::nullptr_t, T *&) { invalidate(); };
+    chain.add(setDefaultSym, true, false, 0, (void *)fn);
+  }
+};
+
+// Fixed set of services addressed by position or type, both resolved at compile time:
+//
+//   using Services = ServiceTable<AppPlatform, Minecraft>;
+//   Services::get<0>();           // AppPlatform &
+//   Services::get<Minecraft>();   // same as ServiceHandle<Minecraft>::get()
+template <typename... Ts> struct ServiceTable {
+  template <std::size_t I> using type = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+  template <typename T> static constexpr std::size_t index() {
+    std::size_t i = 0, found = sizeof...(Ts);
+    ((std::is_same_v<T, Ts> && found == sizeof...(Ts) ? found = i : ++i), ...);
+    return found;
+  }
+
+  template <std::size_t I> static type<I> &get() { return ServiceHandle<type<I>>::get(); }
+  template <typename T> static T &get() {
+    static_assert(index<T>() < sizeof...(Ts), "service is not part of this table");
+    return ServiceHandle<T>::get();
+  }
+
+  // Resolves every service up front, e.g. once the level has loaded, so no hot path pays for the first lookup.
+  static void warm() { (ServiceHandle<Ts>::refresh(), ...); }
+  static void invalidate() { (ServiceHandle<Ts>::invalidate(), ...); }
+};
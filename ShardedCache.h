@@ -0,0 +1,380 @@
+#pragma once
+
+#include "minecraft/LevelStorage.h"
+#include <HookChain.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <shared_mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Drop-in leveldb::Cache for DBStorage::db_cache. Keys are spread over many shards, and a shard is only locked
+// exclusively to insert, erase or evict. Lookups take the shard's lock shared and pin the entry with an atomic
+// refcount. Release never locks. Chunk loading threads and the autosave thread therefore only wait on each other when
+// one of them is filling the same shard.
+//
+// Eviction is CLOCK with a saturating 2-bit use counter: a lookup bumps the counter, and the hand decrements it on each
+// pass. A block is evicted once it has been passed over unused more often than it was read. Unlike LRU, a hit never
+// relinks the entry, so hits are cheap.
+//
+// install() swaps the cache in while DBStorage is constructed; of(*storage) then returns it for metrics():
+//
+//   ShardedCache::install();
+//   ...
+//   if (auto cache = ShardedCache::of(*storage)) cache->dump(std::cerr);
+struct ShardedCache : leveldb::Cache {
+  static constexpr std::size_t defaultShards = 64;
+  static constexpr std::uint8_t maxUses      = 3;
+
+  struct Entry : leveldb::Cache::Handle {
+    void *value;
+    void (*deleter)(leveldb::Slice const &, void *);
+    std::size_t charge;
+    std::size_t hash;
+    std::atomic<std::uint32_t> refs{ 1 }; // one for the cache while the entry is in it, one per outstanding handle
+    std::atomic<std::uint8_t> uses{ 0 };
+    Entry *nextHash = nullptr;
+    Entry *prev = nullptr, *next = nullptr; // clock ring, guarded by the shard lock
+    std::uint32_t keySize;
+    char key[1];
+
+    leveldb::Slice slice() const { return { key, keySize }; }
+  };
+
+  struct Metrics {
+    std::uint64_t hits = 0, misses = 0, inserts = 0, evictions = 0;
+    std::size_t charge = 0, capacity = 0, entries = 0;
+    double hitRatio() const { return hits + misses ? (double)hits / (hits + misses) : 0; }
+  };
+
+  struct alignas(64) Shard {
+    std::shared_mutex mutex;
+    std::vector<Entry *> buckets = std::vector<Entry *>(16); // power of two
+    std::size_t count            = 0;
+    Entry *hand                  = nullptr;
+    std::size_t capacity         = 0;
+    std::atomic<std::size_t> usage{ 0 };
+    std::atomic<std::uint64_t> hits{ 0 }, misses{ 0 }, inserts{ 0 }, evictions{ 0 };
+  };
+
+  std::unique_ptr<Shard[]> shards;
+  std::size_t shardMask;
+  std::size_t capacity;
+  std::atomic<std::uint64_t> lastId{ 0 };
+
+  explicit ShardedCache(std::size_t capacity, std::size_t shardCount = defaultShards) : capacity(capacity) {
+    std::size_t count = 1;
+    while (count < shardCount) count <<= 1;
+    shards.reset(new Shard[count]);
+    shardMask = count - 1;
+    for (std::size_t i = 0; i < count; i++) shards[i].capacity = (capacity + count - 1) / count;
+    std::lock_guard lock(registryMutex());
+    registry().push_back(this);
+  }
+
+  ~ShardedCache() override {
+    {
+      std::lock_guard lock(registryMutex());
+      auto &list = registry();
+      list.erase(std::remove(list.begin(), list.end(), this), list.end());
+    }
+    for (std::size_t i = 0; i <= shardMask; i++) {
+      auto &shard = shards[i];
+      while (auto entry = shard.hand) {
+        unlinkRing(shard, entry);
+        unref(entry);
+      }
+    }
+  }
+
+  Handle *Insert(leveldb::Slice const &key, void *value, std::size_t charge, void (*deleter)(leveldb::Slice const &, void *)) override {
+    auto hash  = hashOf(key);
+    auto entry = (Entry *)malloc(sizeof(Entry) - 1 + key.size());
+    new (entry) Entry;
+    entry->value   = value;
+    entry->deleter = deleter;
+    entry->charge  = charge;
+    entry->hash    = hash;
+    entry->keySize = (std::uint32_t)key.size();
+    memcpy(entry->key, key.data(), key.size());
+    entry->refs.store(2, std::memory_order_relaxed); // the cache's and the returned handle's
+
+    auto &shard    = shardOf(hash);
+    Entry *garbage = nullptr;
+    {
+      std::unique_lock lock(shard.mutex);
+      auto slot = find(shard, key, hash);
+      if (auto old = *slot) {
+        entry->nextHash = old->nextHash;
+        *slot           = entry;
+        unlinkRing(shard, old);
+        shard.usage.fetch_sub(old->charge, std::memory_order_relaxed);
+        drop(old, garbage);
+      } else {
+        *slot = entry;
+        if (++shard.count > shard.buckets.size()) grow(shard);
+      }
+      linkRing(shard, entry);
+      shard.usage.fetch_add(charge, std::memory_order_relaxed);
+      shard.inserts.fetch_add(1, std::memory_order_relaxed);
+      evict(shard, garbage);
+    }
+    destroy(garbage);
+    return entry;
+  }
+
+  Handle *Lookup(leveldb::Slice const &key) override {
+    auto hash   = hashOf(key);
+    auto &shard = shardOf(hash);
+    std::shared_lock lock(shard.mutex);
+    auto entry = *find(shard, key, hash);
+    if (!entry) {
+      shard.misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    // Racing readers may lose an increment; the counter only has to tell hot blocks from cold ones.
+    auto uses = entry->uses.load(std::memory_order_relaxed);
+    if (uses < maxUses) entry->uses.store(uses + 1, std::memory_order_relaxed);
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+  }
+
+  void Release(Handle *handle) override { unref((Entry *)handle); }
+
+  void *Value(Handle *handle) override { return ((Entry *)handle)->value; }
+
+  void Erase(leveldb::Slice const &key) override {
+    auto hash      = hashOf(key);
+    auto &shard    = shardOf(hash);
+    Entry *garbage = nullptr;
+    {
+      std::unique_lock lock(shard.mutex);
+      if (auto entry = *find(shard, key, hash)) remove(shard, entry, garbage);
+    }
+    destroy(garbage);
+  }
+
+  uint64_t NewId() override { return lastId.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+  void Prune() override {
+    for (std::size_t i = 0; i <= shardMask; i++) {
+      auto &shard    = shards[i];
+      Entry *garbage = nullptr;
+      {
+        std::unique_lock lock(shard.mutex);
+        for (auto n = shard.count; n && shard.hand; n--) {
+          auto entry = shard.hand;
+          shard.hand = entry->next;
+          if (entry->refs.load(std::memory_order_acquire) == 1) remove(shard, entry, garbage);
+        }
+      }
+      destroy(garbage);
+    }
+  }
+
+  size_t TotalCharge() const override {
+    std::size_t total = 0;
+    for (std::size_t i = 0; i <= shardMask; i++) total += shards[i].usage.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  Metrics metrics() const {
+    Metrics result;
+    result.capacity = capacity;
+    for (std::size_t i = 0; i <= shardMask; i++) {
+      auto &shard = shards[i];
+      result.hits += shard.hits.load(std::memory_order_relaxed);
+      result.misses += shard.misses.load(std::memory_order_relaxed);
+      result.inserts += shard.inserts.load(std::memory_order_relaxed);
+      result.evictions += shard.evictions.load(std::memory_order_relaxed);
+      result.charge += shard.usage.load(std::memory_order_relaxed);
+      std::shared_lock lock(shard.mutex);
+      result.entries += shard.count;
+    }
+    return result;
+  }
+
+  void dump(std::ostream &os) const {
+    auto m = metrics();
+    os << "db_cache: " << m.charge / 1048576.0 << "MiB of " << m.capacity / 1048576.0 << "MiB in " << m.entries << " entries, hit ratio " << m.hitRatio() * 100 << "% ("
+       << m.hits << " hits, " << m.misses << " misses), " << m.inserts << " inserts, " << m.evictions << " evictions\n";
+    os.flush();
+  }
+
+  // Shared with every other user of the DBStorage constructor, so they all sit on one trampoline. References are
+  // spelled as pointers, which they are in the ABI, so the chain never needs the referenced types.
+  using ConstructorChain = THookChainFor(_ZN9DBStorageC2ERKNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEER9SchedulerS7_RK15ContentIdentityRK19IContentKeyProviderSt10shared_ptrI22SaveTransactionManagerENSt6chrono8durationIlSt5ratioILl1ELl1000000000EEEE,
+                                         void(DBStorage *, std::string const *, Scheduler *, std::string const *, ContentIdentity const *, IContentKeyProvider const *,
+                                              std::shared_ptr<SaveTransactionManager>, std::chrono::nanoseconds));
+  using NewLRUCacheChain = THookChainFor(_ZN7leveldb11NewLRUCacheEm, leveldb::Cache *(std::size_t));
+
+  // Makes the next DBStorage build its block cache as a ShardedCache of the same capacity. Call before the level loads.
+  //
+  // The constructor's first NewLRUCache call is the one that gets replaced. A post-hook on the constructor disarms and
+  // checks that this cache really ended up in db_cache, and says so on stderr if it did not; the replaced cache still
+  // works, it just is not the block cache, and of() will not return it.
+  static void install(std::size_t shardCount = defaultShards) {
+    ShardedCache::shardCount() = shardCount;
+    void (*arm)(DBStorage *&, std::string const *&, Scheduler *&, std::string const *&, ContentIdentity const *&, IContentKeyProvider const *&,
+                std::shared_ptr<SaveTransactionManager> &, std::chrono::nanoseconds &) = [](auto &...) {
+      armed() = true;
+      built() = nullptr;
+    };
+    void (*check)(std::nullptr_t, DBStorage *&, std::string const *&, Scheduler *&, std::string const *&, ContentIdentity const *&, IContentKeyProvider const *&,
+                  std::shared_ptr<SaveTransactionManager> &, std::chrono::nanoseconds &) = [](std::nullptr_t, DBStorage *&storage, auto &...) {
+      auto cache = std::exchange(built(), nullptr);
+      armed()    = false;
+      if (!cache)
+        std::cerr << "[ShardedCache] DBStorage did not create its block cache through leveldb::NewLRUCache, kept the server's own" << std::endl;
+      else if (storage->db_cache.get() != cache)
+        std::cerr << "[ShardedCache] DBStorage's first NewLRUCache call was not db_cache, left db_cache as the server's own" << std::endl;
+    };
+    ConstructorChain::get().add("_ZN9DBStorageC2ERKNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEER9SchedulerS7_RK15ContentIdentityRK19IContentKeyProviderSt10"
+                                "shared_ptrI22SaveTransactionManagerENSt6chrono8durationIlSt5ratioILl1ELl1000000000EEEE",
+                                false, false, 0, (void *)arm);
+    ConstructorChain::get().add("_ZN9DBStorageC2ERKNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEER9SchedulerS7_RK15ContentIdentityRK19IContentKeyProviderSt10"
+                                "shared_ptrI22SaveTransactionManagerENSt6chrono8durationIlSt5ratioILl1ELl1000000000EEEE",
+                                true, false, 0, (void *)check);
+    void (*replace)(leveldb::Cache *&, std::size_t &) = [](leveldb::Cache *&result, std::size_t &capacity) {
+      if (!armed()) return;
+      armed() = false;
+      delete result;
+      result = built() = new ShardedCache(capacity, ShardedCache::shardCount());
+    };
+    NewLRUCacheChain::get().add("_ZN7leveldb11NewLRUCacheEm", true, false, 0, (void *)replace);
+  }
+
+  // The cache install() gave this storage, or null if it kept the server's own.
+  static ShardedCache *of(DBStorage &storage) {
+    std::lock_guard lock(registryMutex());
+    for (auto cache : registry())
+      if (cache == storage.db_cache.get()) return cache;
+    return nullptr;
+  }
+
+private:
+  // Set by the DBStorage constructor's pre-hook and consumed by its first NewLRUCache call; the post-hook clears both.
+  static bool &armed() {
+    static thread_local bool flag = false;
+    return flag;
+  }
+  static ShardedCache *&built() {
+    static thread_local ShardedCache *cache = nullptr;
+    return cache;
+  }
+  static std::size_t &shardCount() {
+    static std::size_t count = defaultShards;
+    return count;
+  }
+  static std::vector<ShardedCache *> &registry() {
+    static std::vector<ShardedCache *> list;
+    return list;
+  }
+  static std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::size_t hashOf(leveldb::Slice const &key) { return std::hash<std::string_view>{}({ key.data(), key.size() }); }
+
+  // Shards are picked by the high half of the hash and buckets by the low half.
+  Shard &shardOf(std::size_t hash) const { return shards[(hash >> 32) & shardMask]; }
+
+  static Entry **find(Shard &shard, leveldb::Slice const &key, std::size_t hash) {
+    auto slot = &shard.buckets[hash & (shard.buckets.size() - 1)];
+    while (*slot && ((*slot)->hash != hash || (*slot)->slice() != key)) slot = &(*slot)->nextHash;
+    return slot;
+  }
+
+  static void grow(Shard &shard) {
+    std::vector<Entry *> buckets(shard.buckets.size() * 2);
+    for (auto head : shard.buckets)
+      while (auto entry = head) {
+        head            = entry->nextHash;
+        auto &bucket    = buckets[entry->hash & (buckets.size() - 1)];
+        entry->nextHash = bucket;
+        bucket          = entry;
+      }
+    shard.buckets.swap(buckets);
+  }
+
+  // New entries go right behind the hand, so they get a full turn before it reaches them.
+  static void linkRing(Shard &shard, Entry *entry) {
+    if (!shard.hand) {
+      shard.hand  = entry;
+      entry->prev = entry->next = entry;
+      return;
+    }
+    entry->next       = shard.hand;
+    entry->prev       = shard.hand->prev;
+    entry->prev->next = entry;
+    shard.hand->prev  = entry;
+  }
+
+  static void unlinkRing(Shard &shard, Entry *entry) {
+    if (entry->next == entry) {
+      shard.hand = nullptr;
+      return;
+    }
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    if (shard.hand == entry) shard.hand = entry->next;
+  }
+
+  // Drops the cache's reference; an entry nobody else holds is queued so its deleter runs outside the lock.
+  static void drop(Entry *entry, Entry *&garbage) {
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    entry->nextHash = garbage;
+    garbage         = entry;
+  }
+
+  static void remove(Shard &shard, Entry *entry, Entry *&garbage) {
+    *find(shard, entry->slice(), entry->hash) = entry->nextHash;
+    unlinkRing(shard, entry);
+    shard.count--;
+    shard.usage.fetch_sub(entry->charge, std::memory_order_relaxed);
+    drop(entry, garbage);
+  }
+
+  // Called with the shard locked exclusively, so no lookup can pin an entry while the hand looks at it. Entries pinned by
+  // handles are skipped; if every entry is pinned, the shard stays over capacity until they are released.
+  static void evict(Shard &shard, Entry *&garbage) {
+    for (auto budget = shard.count * (maxUses + 1); budget && shard.hand && shard.usage.load(std::memory_order_relaxed) > shard.capacity; budget--) {
+      auto entry = shard.hand;
+      shard.hand = entry->next;
+      if (entry->refs.load(std::memory_order_acquire) > 1) continue;
+      if (auto uses = entry->uses.load(std::memory_order_relaxed)) {
+        entry->uses.store(uses - 1, std::memory_order_relaxed);
+        continue;
+      }
+      remove(shard, entry, garbage);
+      shard.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  static void unref(Entry *entry) {
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    entry->nextHash = nullptr;
+    destroy(entry);
+  }
+
+  static void destroy(Entry *list) {
+    while (auto entry = list) {
+      list = entry->nextHash;
+      entry->deleter(entry->slice(), entry->value);
+      entry->~Entry();
+      free(entry);
+    }
+  }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Mod-side replacement for the server's ThreadLocal<T>, which registers every new thread under one mutex. Here each
+// thread finds its own slot through a plain thread_local table indexed by instance id, and a thread's first access
+// links a new slot into the instance's list with a single CAS, so no access ever takes a lock.
+//
+// Slots outlive the threads that created them: each() still visits the values of exited threads, which is what
+// per-thread counters want, and scratch buffers are freed together with the instance.
+//
+//   ShardedThreadLocal<std::atomic<std::uint64_t>> written;
+//   written.local().fetch_add(size, std::memory_order_relaxed);
+//   auto total = written.reduce<std::uint64_t>(0, [](auto sum, auto &count) { return sum + count.load(); });
+template <typename T> struct ShardedThreadLocal {
+  // Cache-line aligned so counters bumped by different threads do not share a line.
+  struct alignas(64) Slot {
+    T value;
+    Slot *next = nullptr;
+    Slot() : value() {}
+    // Built in place from the initializer's result, so T need not be copyable or movable.
+    explicit Slot(std::function<T()> const &make) : value(make()) {}
+  };
+
+  // A thread's table entry for this instance: valid only while its generation matches the instance's.
+  struct Entry {
+    void *slot;
+    std::uint64_t generation;
+  };
+
+  std::atomic<Slot *> head{ nullptr };
+  std::function<T()> init;
+  std::uint64_t const generation = nextGeneration().fetch_add(1, std::memory_order_relaxed);
+  std::uint32_t const id         = acquireId();
+
+  // Without an initializer every thread starts from a value-initialized T.
+  ShardedThreadLocal() {}
+  explicit ShardedThreadLocal(std::function<T()> init) : init(std::move(init)) {}
+  ShardedThreadLocal(ShardedThreadLocal const &) = delete;
+  ShardedThreadLocal &operator=(ShardedThreadLocal const &) = delete;
+
+  // No thread may use the instance any more.
+  ~ShardedThreadLocal() {
+    for (auto slot = head.load(std::memory_order_acquire); slot;) {
+      auto next = slot->next;
+      delete slot;
+      slot = next;
+    }
+    std::lock_guard lock(idMutex());
+    freeIds().push_back(id);
+  }
+
+  T &local() {
+    auto &table = slots();
+    if (__builtin_expect(id < table.size() && table[id].generation == generation, 1)) return static_cast<Slot *>(table[id].slot)->value;
+    return attach(table)->value;
+  }
+  T &operator*() { return local(); }
+  T *operator->() { return &local(); }
+
+  // True once the calling thread has a slot.
+  bool checkLocal() const {
+    auto &table = slots();
+    return id < table.size() && table[id].generation == generation;
+  }
+
+  // Visits the value of every thread that has touched this instance. Slots added while iterating may be missed, and
+  // values still being written by their threads must be safe to read concurrently (e.g. atomics).
+  template <typename F> void each(F &&fn) {
+    for (auto slot = head.load(std::memory_order_acquire); slot; slot = slot->next) fn(slot->value);
+  }
+
+  template <typename R, typename F> R reduce(R acc, F &&fn) {
+    each([&](T &value) { acc = fn(std::move(acc), value); });
+    return acc;
+  }
+
+  std::size_t threads() const {
+    std::size_t count = 0;
+    for (auto slot = head.load(std::memory_order_acquire); slot; slot = slot->next) count++;
+    return count;
+  }
+
+private:
+  // Ids index every thread's table, so they are recycled through a free list to keep the tables as small as the
+  // largest number of instances alive at once. Generations are never reused: an entry a thread kept for a destroyed
+  // instance carries the old generation, so the next owner of the id never mistakes it for its own slot.
+  static std::atomic<std::uint64_t> &nextGeneration() {
+    static std::atomic<std::uint64_t> counter{ 1 };
+    return counter;
+  }
+  static std::mutex &idMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+  static std::vector<std::uint32_t> &freeIds() {
+    static std::vector<std::uint32_t> list;
+    return list;
+  }
+  static std::uint32_t acquireId() {
+    static std::uint32_t nextId = 0;
+    std::lock_guard lock(idMutex());
+    auto &list = freeIds();
+    if (list.empty()) return nextId++;
+    auto id = list.back();
+    list.pop_back();
+    return id;
+  }
+
+  static std::vector<Entry> &slots() {
+    static thread_local std::vector<Entry> table;
+    return table;
+  }
+
+  Slot *attach(std::vector<Entry> &table) {
+    auto slot = init ? new Slot(init) : new Slot();
+    slot->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {}
+    if (id >= table.size()) table.resize(id + 1);
+    table[id] = Entry{ slot, generation };
+    return slot;
+  }
+};
@@ -1,63 +1,385 @@
 #pragma once
 
+#include <SymbolCache.h>
+#include <SymbolTable.h>
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <dlfcn.h>
+#include <fstream>
 #include <hook.h>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
-struct RegisterStaticHook {
-  // static const void *handle = dlopen(nullptr, RTLD_LAZY);
+// When a queued hook is installed. Nothing commits the later phases automatically: each mod must call
+// StaticHookRegistry::get().commit(HookPhase::AfterLevelLoad) itself once the level has loaded (e.g. from a Level
+// constructor post-hook), or its AfterLevelLoad hooks stay pending. OnFirstUse hooks are installed by their _install()
+// or by commit(HookPhase::OnFirstUse).
+enum class HookPhase { Early, AfterLevelLoad, OnFirstUse };
+
+// Collects hooks registered during static initialization and resolves them in one pass over the server's symbol tables.
+// Build with STATICHOOK_BATCH and call StaticHookRegistry::get().commit() once the mod is loaded; without it every early
+// hook is resolved and installed on registration as before. Either way, resolved addresses inside the executable are
+// persisted in a SymbolCache, so an unchanged server binary resolves those hooks from the cache file alone.
+//
+// Hooks declared with a later HookPhase are always queued: commit(HookPhase::AfterLevelLoad) installs that phase in one
+// batch, and an OnFirstUse hook is installed by its _install() or by commit(HookPhase::OnFirstUse).
+//
+// Every registration also gets a Record in `manifest`, filled in as the hook is resolved and installed. Each mod has a
+// registry of its own, so each writes $STATICHOOK_MANIFEST.<mod> (the mod's file name), once per commit() and once more
+// when the registry is destroyed at exit, and several mods never overwrite one another. The manifest only holds what is stable across runs,
+// so it can be diffed across server updates; install timings go to $STATICHOOK_MANIFEST.<mod>.timing. With
+// STATICHOOK_FAIL_FAST (or setFailFast(true)) a missing symbol aborts the server once the batch has been reported.
+struct __attribute__((visibility("hidden"))) StaticHookRegistry {
+  enum class Status { Pending, Installed, Missing };
+  struct Entry {
+    const char *sym;
+    void *hook;
+    void **org;
+    void *target;
+    HookPhase phase;
+    std::size_t record;
+  };
+  struct Record {
+    const char *name;
+    const char *sym;
+    std::atomic<bool> *enabled;
+    HookPhase phase;
+    Status status;
+    void *target;
+    uint64_t installNanos;
+  };
+
+  std::vector<Entry> pending;
+  std::vector<Record> manifest;
+  std::vector<std::pair<std::string_view, void *>> uncached; // live lookups waiting to be written to the cache
+  bool committed[3] = {};
+#ifdef STATICHOOK_FAIL_FAST
+  bool failFast = true;
+#else
+  bool failFast = false;
+#endif
+
+  // The cache and the mod name are built first so that they outlive the registry, whose destructor uses both.
+  StaticHookRegistry() {
+    cache();
+    modName();
+  }
+  ~StaticHookRegistry() {
+    flushCache();
+    saveManifest();
+  }
+
+  static StaticHookRegistry &get() {
+    static StaticHookRegistry registry;
+    return registry;
+  }
+
+  static SymbolCache &cache() {
+    static SymbolCache cache;
+    return cache;
+  }
+
+  // Outside a batch every live lookup is queued for the cache and written with the next commit(), or when the registry
+  // is destroyed, so the first run warms it either way without rewriting the file once per hook.
+  void *resolve(const char *sym) {
+    if (auto addr = cache().find(sym)) return addr;
+    auto addr = dlsym(MinecraftHandle(), sym);
+    if (addr) uncached.emplace_back(sym, addr);
+    return addr;
+  }
+
+  void flushCache() {
+    if (uncached.empty()) return;
+    cache().store(std::move(uncached));
+    uncached.clear();
+  }
 
-  RegisterStaticHook(const char *sym, void *hook, void **org) {
-    auto r = dlsym(MinecraftHandle(), sym);
-    if (r == nullptr) {
-      std::cerr << "Symbol not found: " << sym << std::endl;
+  void setFailFast(bool value) { failFast = value; }
+
+  void add(const char *sym, void *hook, void **org, HookPhase phase = HookPhase::Early, const char *name = nullptr, std::atomic<bool> *enabled = nullptr) {
+    Entry entry{ sym, hook, org, nullptr, phase, manifest.size() };
+    manifest.push_back(Record{ name ? name : sym, sym, enabled, phase, Status::Pending, nullptr, 0 });
+    bool deferred = phase != HookPhase::Early;
+#ifdef STATICHOOK_BATCH
+    deferred = true;
+#endif
+    if (deferred && !committed[(int)phase]) {
+      pending.push_back(entry);
       return;
     }
-    MSHookFunction(r, hook, org);
+    entry.target = resolve(sym);
+    if (!install(entry) && failFast) abort(sym);
+  }
+
+  // Turns a hook's body on or off by name without touching the patched code; a disabled hook calls straight through to
+  // the original. Returns false if no hook with that name is registered.
+  bool setEnabled(std::string_view name, bool enabled) {
+    bool found = false;
+    for (auto &record : manifest)
+      if (record.enabled && name == record.name) {
+        record.enabled->store(enabled, std::memory_order_relaxed);
+        found = true;
+      }
+    return found;
+  }
+
+  // Installs a single queued hook now, e.g. right before the feature that needs it is first used.
+  bool ensure(void **org) {
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+      if (it->org != org) continue;
+      auto entry = *it;
+      pending.erase(it);
+      if (!entry.target) entry.target = resolve(entry.sym);
+      bool ok = install(entry);
+      if (!ok && failFast) abort(entry.sym);
+      return ok;
+    }
+    return false;
+  }
+
+  // Resolves everything still queued, then installs the hooks of the given phase in address order. Hooks on the same
+  // target keep their registration order, so they chain the same way on every run.
+  void commit(HookPhase phase = HookPhase::Early) {
+    using clock            = std::chrono::steady_clock;
+    committed[(int)phase]  = true;
+    auto started           = clock::now();
+    std::size_t cached     = 0;
+    std::size_t unresolved = 0;
+    for (auto &entry : pending) {
+      if (entry.target) continue;
+      if ((entry.target = cache().find(entry.sym)))
+        cached++;
+      else
+        unresolved++;
+    }
+    auto loaded = clock::now();
+
+    std::unordered_map<std::string_view, Entry *> index;
+    std::bitset<4096> lengths;
+    for (auto &entry : pending) {
+      if (entry.target) continue;
+      std::string_view name{ entry.sym };
+      index.emplace(name, &entry);
+      lengths.set(std::min(name.size(), lengths.size() - 1));
+    }
+    auto indexed = clock::now();
+
+    if (unresolved) {
+      unresolved = index.size();
+      SymbolTable table;
+      table.forEach([&](std::string_view name, void *addr) {
+        if (unresolved == 0 || !lengths.test(std::min(name.size(), lengths.size() - 1))) return;
+        auto it = index.find(name);
+        if (it == index.end() || it->second->target) return;
+        it->second->target = addr;
+        unresolved--;
+      });
+      for (auto &[name, entry] : index) {
+        if (!entry->target) entry->target = dlsym(MinecraftHandle(), entry->sym);
+        if (entry->target) uncached.emplace_back(name, entry->target);
+      }
+      for (auto &entry : pending)
+        if (!entry.target) entry.target = index[entry.sym]->target;
+    }
+    flushCache();
+    auto resolved = clock::now();
+
+    auto batchEnd = std::stable_partition(pending.begin(), pending.end(), [=](Entry const &entry) { return entry.phase == phase; });
+    std::stable_sort(pending.begin(), batchEnd, [](Entry const &a, Entry const &b) { return a.target < b.target; });
+    std::size_t count = batchEnd - pending.begin(), missing = 0;
+    const char *firstMissing = nullptr;
+    for (auto it = pending.begin(); it != batchEnd; ++it)
+      if (!install(*it) && !missing++) firstMissing = it->sym;
+    pending.erase(pending.begin(), batchEnd);
+    auto installed = clock::now();
+
+    using ms = std::chrono::duration<double, std::milli>;
+    std::cerr << "[StaticHook] phase " << (int)phase << ": " << count << " hooks (" << cached << " cached, " << missing << " missing, " << pending.size()
+              << " deferred): cache " << ms(loaded - started).count() << "ms, index " << ms(indexed - loaded).count() << "ms, resolve "
+              << ms(resolved - indexed).count() << "ms, install " << ms(installed - resolved).count() << "ms" << std::endl;
+    if (pending.empty()) pending.shrink_to_fit();
+    saveManifest();
+    if (missing && failFast) abort(firstMissing);
+  }
+
+  // One tab-separated line per hook: name, symbol, phase, status and where the target lives, as an offset from the
+  // executable's load base or as <object>+offset for a symbol found in another shared object.
+  void writeManifest(std::ostream &os) const {
+    static const char *statuses[] = { "pending", "installed", "missing" };
+    for (auto &record : manifest)
+      os << record.name << '\t' << record.sym << '\t' << (int)record.phase << '\t' << statuses[(int)record.status] << '\t' << location(record.target) << '\n';
+    os.flush();
+  }
+
+  // One tab-separated line per installed hook: name and MSHookFunction time in nanoseconds.
+  void writeTimings(std::ostream &os) const {
+    for (auto &record : manifest)
+      if (record.status == Status::Installed) os << record.name << '\t' << record.installNanos << '\n';
+    os.flush();
+  }
+
+private:
+  static std::string location(void *target) {
+    char buffer[64];
+    if (!target) return "-";
+    if (cache().owns(target)) {
+      snprintf(buffer, sizeof(buffer), "0x%lx", (unsigned long)((uintptr_t)target - cache().base));
+      return buffer;
+    }
+    Dl_info info;
+    if (!dladdr(target, &info) || !info.dli_fname) return "?";
+    auto slash = strrchr(info.dli_fname, '/');
+    snprintf(buffer, sizeof(buffer), "+0x%lx", (unsigned long)((uintptr_t)target - (uintptr_t)info.dli_fbase));
+    return (slash ? slash + 1 : info.dli_fname) + std::string(buffer);
+  }
+
+  // The file name of the mod this registry belongs to; registries are hidden, so each mod has its own.
+  static std::string const &modName() {
+    static std::string name = [] {
+      Dl_info info;
+      if (!dladdr((void *)&modName, &info) || !info.dli_fname || !*info.dli_fname) return std::string("main");
+      auto slash = strrchr(info.dli_fname, '/');
+      return std::string(slash ? slash + 1 : info.dli_fname);
+    }();
+    return name;
+  }
+
+  void saveManifest() const {
+    auto path = getenv("STATICHOOK_MANIFEST");
+    if (!path || !*path) return;
+    auto base = std::string(path) + "." + modName();
+    std::ofstream manifestFile{ base };
+    writeManifest(manifestFile);
+    std::ofstream timingFile{ base + ".timing" };
+    writeTimings(timingFile);
+  }
+
+  bool install(Entry const &entry) {
+    auto &record  = manifest[entry.record];
+    record.target = entry.target;
+    if (entry.target == nullptr) {
+      record.status = Status::Missing;
+      std::cerr << "Symbol not found: " << entry.sym << std::endl;
+      return false;
+    }
+    auto started = std::chrono::steady_clock::now();
+    MSHookFunction(entry.target, entry.hook, entry.org);
+    record.installNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+    record.status       = Status::Installed;
+    return true;
+  }
+
+  // The registry's destructor never runs after this, so the manifest is written here.
+  [[noreturn]] void abort(const char *sym) {
+    saveManifest();
+    std::cerr << "[StaticHook] aborting: required symbol " << sym << " is missing" << std::endl;
+    std::abort();
+  }
+};
+
+struct RegisterStaticHook {
+  // static const void *handle = dlopen(nullptr, RTLD_LAZY);
+
+  RegisterStaticHook(const char *sym, void *hook, void **org, HookPhase phase = HookPhase::Early, const char *name = nullptr,
+                     std::atomic<bool> *enabled = nullptr) {
+    StaticHookRegistry::get().add(sym, hook, org, phase, name, enabled);
   }
 
   // workaround for a warning
-  template <typename T> RegisterStaticHook(const char *sym, T hook, void **org) {
+  template <typename T>
+  RegisterStaticHook(const char *sym, T hook, void **org, HookPhase phase = HookPhase::Early, const char *name = nullptr,
+                     std::atomic<bool> *enabled = nullptr) {
     union {
       T a;
       void *b;
     } hookUnion;
     hookUnion.a = hook;
-    RegisterStaticHook(sym, hookUnion.b, org);
+    RegisterStaticHook(sym, hookUnion.b, org, phase, name, enabled);
+  }
+};
+
+#ifdef STATICHOOK_PROFILE
+#include <HookStats.h>
+#define _THookStats(iname) inline static HookStats _stats{ #iname };
+#else
+#define _THookStats(iname)
+#endif
+
+// Entry point registered for every hook: checks H::_enabled with one predictable branch and either runs the hook body or
+// calls straight through to the original.
+template <typename H, auto Hook> struct HookEntry;
+
+template <typename H, typename Ret, typename... Args, Ret (*Hook)(Args...)> struct HookEntry<H, Hook> {
+  static Ret call(Args... args) {
+    if (__builtin_expect(!H::_enabled.load(std::memory_order_relaxed), 0)) return H::_original(std::forward<Args>(args)...);
+#ifdef STATICHOOK_PROFILE
+    HookTimer timer{ H::_stats };
+#endif
+    return Hook(std::forward<Args>(args)...);
+  }
+};
+
+template <typename H, typename Ret, typename... Args, Ret (H::*Hook)(Args...)> struct HookEntry<H, Hook> {
+  static Ret call(H *self, Args... args) {
+    if (__builtin_expect(!H::_enabled.load(std::memory_order_relaxed), 0)) return (self->*H::_original)(std::forward<Args>(args)...);
+#ifdef STATICHOOK_PROFILE
+    HookTimer timer{ H::_stats };
+#endif
+    return (self->*Hook)(std::forward<Args>(args)...);
   }
 };
 
-#define _TInstanceHook(class_inh, pclass, iname, sym, ret, args...)                                                                                  \
+#define _TInstanceHook(class_inh, pclass, iname, sym, phase, ret, args...)                                                                           \
   struct _TInstanceHook_##iname class_inh {                                                                                                          \
     static ret (_TInstanceHook_##iname::*_original)(args);                                                                                           \
     template <typename... Params> static ret original(pclass *_this, Params &&... params) {                                                          \
       return (((_TInstanceHook_##iname *)_this)->*_original)(std::forward<Params>(params)...);                                                       \
     }                                                                                                                                                \
+    static bool _install() { return StaticHookRegistry::get().ensure((void **)&_original); }                                                         \
+    inline static std::atomic<bool> _enabled{ true };                                                                                                \
+    _THookStats(iname)                                                                                                                               \
     ret _hook(args);                                                                                                                                 \
   };                                                                                                                                                 \
-  static RegisterStaticHook _TRInstanceHook_##iname(#sym, &_TInstanceHook_##iname::_hook, (void **)&_TInstanceHook_##iname::_original);              \
+  static RegisterStaticHook _TRInstanceHook_##iname(#sym, &HookEntry<_TInstanceHook_##iname, &_TInstanceHook_##iname::_hook>::call,                  \
+                                                  (void **)&_TInstanceHook_##iname::_original, phase, #iname, &_TInstanceHook_##iname::_enabled);    \
   ret (_TInstanceHook_##iname::*_TInstanceHook_##iname::_original)(args);                                                                            \
   ret _TInstanceHook_##iname::_hook(args)
-#define _TInstanceDefHook(iname, sym, ret, type, args...) _TInstanceHook( : public type, type, iname, sym, ret, args)
-#define _TInstanceNoDefHook(iname, sym, ret, args...) _TInstanceHook(, void, iname, sym, ret, args)
+#define _TInstanceDefHook(iname, sym, phase, ret, type, args...) _TInstanceHook( : public type, type, iname, sym, phase, ret, args)
+#define _TInstanceNoDefHook(iname, sym, phase, ret, args...) _TInstanceHook(, void, iname, sym, phase, ret, args)
 
-#define _TStaticHook(pclass, iname, sym, ret, args...)                                                                                               \
+#define _TStaticHook(pclass, iname, sym, phase, ret, args...)                                                                                        \
   struct _TStaticHook_##iname pclass {                                                                                                               \
     static ret (*_original)(args);                                                                                                                   \
     template <typename... Params> static ret original(Params &&... params) { return (*_original)(std::forward<Params>(params)...); }                 \
+    static bool _install() { return StaticHookRegistry::get().ensure((void **)&_original); }                                                         \
+    inline static std::atomic<bool> _enabled{ true };                                                                                                \
+    _THookStats(iname)                                                                                                                               \
     static ret _hook(args);                                                                                                                          \
   };                                                                                                                                                 \
-  static RegisterStaticHook _TRStaticHook_##iname(#sym, &_TStaticHook_##iname::_hook, (void **)&_TStaticHook_##iname::_original);                    \
+  static RegisterStaticHook _TRStaticHook_##iname(#sym, &HookEntry<_TStaticHook_##iname, &_TStaticHook_##iname::_hook>::call,                        \
+                                                  (void **)&_TStaticHook_##iname::_original, phase, #iname, &_TStaticHook_##iname::_enabled);        \
   ret (*_TStaticHook_##iname::_original)(args);                                                                                                      \
   ret _TStaticHook_##iname::_hook(args)
-#define _TStaticDefHook(iname, sym, ret, type, args...) _TStaticHook( : public type, iname, sym, ret, args)
-#define _TStaticNoDefHook(iname, sym, ret, args...) _TStaticHook(, iname, sym, ret, args)
+#define _TStaticDefHook(iname, sym, phase, ret, type, args...) _TStaticHook( : public type, iname, sym, phase, ret, args)
+#define _TStaticNoDefHook(iname, sym, phase, ret, args...) _TStaticHook(, iname, sym, phase, ret, args)
 
-#define THook2(iname, ret, sym, args...) _TStaticNoDefHook(iname, sym, ret, args)
+#define THook2(iname, ret, sym, args...) _TStaticNoDefHook(iname, sym, HookPhase::Early, ret, args)
+#define THook2Phase(iname, phase, ret, sym, args...) _TStaticNoDefHook(iname, sym, HookPhase::phase, ret, args)
 #define THook(ret, sym, args...) THook2(sym, ret, sym, args)
-#define TClasslessInstanceHook2(iname, ret, sym, args...) _TInstanceNoDefHook(iname, sym, ret, args)
+#define TClasslessInstanceHook2(iname, ret, sym, args...) _TInstanceNoDefHook(iname, sym, HookPhase::Early, ret, args)
+#define TClasslessInstanceHook2Phase(iname, phase, ret, sym, args...) _TInstanceNoDefHook(iname, sym, HookPhase::phase, ret, args)
 #define TClasslessInstanceHook(ret, sym, args...) TClasslessInstanceHook2(sym, ret, sym, args)
-#define TInstanceHook2(iname, ret, sym, type, args...) _TInstanceDefHook(iname, sym, ret, type, args)
+#define TInstanceHook2(iname, ret, sym, type, args...) _TInstanceDefHook(iname, sym, HookPhase::Early, ret, type, args)
+#define TInstanceHook2Phase(iname, phase, ret, sym, type, args...) _TInstanceDefHook(iname, sym, HookPhase::phase, ret, type, args)
 #define TInstanceHook(ret, sym, type, args...) TInstanceHook2(sym, ret, sym, type, args)
-#define TStaticHook2(iname, ret, sym, type, args...) _TStaticDefHook(iname, sym, ret, type, args)
-#define TStaticHook(ret, sym, type, args...) TStaticHook2(sym, ret, sym, type, args)
+#define TStaticHook2(iname, ret, sym, type, args...) _TStaticDefHook(iname, sym, HookPhase::Early, ret, type, args)
+#define TStaticHook2Phase(iname, phase, ret, sym, type, args...) _TStaticDefHook(iname, sym, HookPhase::phase, ret, type, args)
+#define TStaticHook(ret, sym, type, args...) TStaticHook2(sym, ret, sym, type, args)
\ No newline at end of file
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Memory-mapped table of mangled name -> offset from the executable's load base, keyed by the executable's GNU build-id.
+// The file lives in $STATICHOOK_CACHE_DIR (default: working directory) and is rewritten whenever new symbols are resolved.
+// Every mod in the server shares it, so a rewrite happens under an flock on <file>.lock and merges the table on disk, not
+// just the mod's own mapping of it.
+// Only addresses inside the executable's own PT_LOAD segments are stored: a symbol dlsym finds in another object (libc,
+// libleveldb) moves independently under ASLR, so it is resolved live on every run.
+struct SymbolCache {
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t buildIdSize;
+    uint8_t buildId[32];
+    uint64_t capacity;
+    uint64_t stringsSize;
+  };
+  struct Slot {
+    uint64_t hash;
+    uint32_t name;
+    uint32_t length;
+    uint64_t offset;
+  };
+  static constexpr char MAGIC[8]    = { 'B', 'D', 'S', 'Y', 'M', 'C', 'C', 'H' };
+  static constexpr uint32_t VERSION = 2;
+
+  std::vector<uint8_t> buildId;
+  uintptr_t base     = 0;
+  uintptr_t imageEnd = 0;
+  void *map          = nullptr;
+  std::size_t size   = 0;
+  const Slot *slots  = nullptr;
+  const char *strings = nullptr;
+  uint64_t capacity  = 0;
+
+  SymbolCache() {
+    dl_iterate_phdr(
+        [](dl_phdr_info *info, std::size_t, void *data) {
+          auto self  = (SymbolCache *)data;
+          self->base = info->dlpi_addr;
+          for (int i = 0; i < info->dlpi_phnum; i++) {
+            auto &ph = info->dlpi_phdr[i];
+            if (ph.p_type == PT_LOAD) self->imageEnd = std::max<uintptr_t>(self->imageEnd, info->dlpi_addr + ph.p_vaddr + ph.p_memsz);
+            if (ph.p_type != PT_NOTE) continue;
+            auto p   = (const char *)(info->dlpi_addr + ph.p_vaddr);
+            auto end = p + ph.p_memsz;
+            while (p + sizeof(ElfW(Nhdr)) <= end) {
+              auto note = (const ElfW(Nhdr) *)p;
+              auto name = p + sizeof(ElfW(Nhdr));
+              auto desc = name + ((note->n_namesz + 3) & ~3u);
+              if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 && note->n_descsz <= sizeof(Header::buildId)) {
+                self->buildId.assign((const uint8_t *)desc, (const uint8_t *)desc + note->n_descsz);
+                break;
+              }
+              p = desc + ((note->n_descsz + 3) & ~3u);
+            }
+          }
+          return 1;
+        },
+        this);
+    load();
+  }
+  SymbolCache(SymbolCache const &) = delete;
+  SymbolCache &operator=(SymbolCache const &) = delete;
+  ~SymbolCache() { unload(); }
+
+  static uint64_t hash(std::string_view name) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : name) h = (h ^ c) * 1099511628211ull;
+    return h | 1;
+  }
+
+  bool enabled() const { return !buildId.empty(); }
+
+  // Whether addr lies in the executable's mapping, i.e. keeps its offset from `base` across runs.
+  bool owns(void *addr) const { return (uintptr_t)addr >= base && (uintptr_t)addr < imageEnd; }
+
+  std::string path() const {
+    static const char digits[] = "0123456789abcdef";
+    auto dir                   = getenv("STATICHOOK_CACHE_DIR");
+    std::string result         = dir && *dir ? dir : ".";
+    result += "/symbols-";
+    for (auto b : buildId) {
+      result += digits[b >> 4];
+      result += digits[b & 15];
+    }
+    return result + ".cache";
+  }
+
+  void *find(std::string_view name) const {
+    if (!slots) return nullptr;
+    auto h = hash(name);
+    for (uint64_t i = h & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+      auto &slot = slots[i];
+      if (slot.hash == 0) return nullptr;
+      if (slot.hash == h && slot.length == name.size() && memcmp(strings + slot.name, name.data(), name.size()) == 0) {
+        auto addr = (void *)(base + slot.offset);
+        return owns(addr) ? addr : nullptr;
+      }
+    }
+  }
+
+  template <typename F> void forEach(F &&fn) const {
+    if (!slots) return;
+    for (uint64_t i = 0; i < capacity; i++)
+      if (slots[i].hash) fn(std::string_view{ strings + slots[i].name, slots[i].length }, (void *)(base + slots[i].offset));
+  }
+
+  // Rewrites the cache with the given symbols plus every entry stored so far, by this mod or any other. Symbols outside
+  // the executable, and ones already cached, are dropped; nothing is written if none are left.
+  bool store(std::vector<std::pair<std::string_view, void *>> symbols) {
+    if (!enabled()) return false;
+    symbols.erase(std::remove_if(symbols.begin(), symbols.end(), [&](auto &symbol) { return !owns(symbol.second) || find(symbol.first); }), symbols.end());
+    if (symbols.empty()) return false;
+    auto target = path();
+    int lock    = open((target + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0) return false;
+    bool ok = flock(lock, LOCK_EX) == 0 && merge(std::move(symbols), target);
+    close(lock);
+    return ok;
+  }
+
+private:
+  // Called with the lock held. Maps the file afresh first, so entries another mod stored since load() are kept.
+  bool merge(std::vector<std::pair<std::string_view, void *>> symbols, std::string const &target) {
+    unload();
+    load();
+    symbols.erase(std::remove_if(symbols.begin(), symbols.end(), [&](auto &symbol) { return find(symbol.first); }), symbols.end());
+    if (symbols.empty()) return false;
+    forEach([&](std::string_view name, void *addr) { symbols.emplace_back(name, addr); });
+    uint64_t cap = 16;
+    while (cap < symbols.size() * 2) cap <<= 1;
+    std::vector<Slot> table(cap);
+    std::string pool;
+    for (auto &[name, addr] : symbols) {
+      auto h = hash(name);
+      auto i = h & (cap - 1);
+      for (; table[i].hash; i = (i + 1) & (cap - 1))
+        if (table[i].hash == h && table[i].length == name.size() && pool.compare(table[i].name, name.size(), name) == 0) break;
+      if (table[i].hash) continue;
+      table[i] = Slot{ h, (uint32_t)pool.size(), (uint32_t)name.size(), (uint64_t)((uintptr_t)addr - base) };
+      pool.append(name);
+    }
+    Header header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version     = VERSION;
+    header.buildIdSize = buildId.size();
+    memcpy(header.buildId, buildId.data(), buildId.size());
+    header.capacity    = cap;
+    header.stringsSize = pool.size();
+
+    auto temp = target + ".tmp";
+    auto file = fopen(temp.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(table.data(), sizeof(Slot), cap, file) == cap &&
+              fwrite(pool.data(), 1, pool.size(), file) == pool.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp.c_str(), target.c_str()) != 0) {
+      unlink(temp.c_str());
+      return false;
+    }
+    unload();
+    load();
+    return true;
+  }
+
+  void load() {
+    if (!enabled()) return;
+    int fd = open(path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (std::size_t)st.st_size >= sizeof(Header)) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        map  = p;
+        size = st.st_size;
+      }
+    }
+    close(fd);
+    if (!map) return;
+    auto header = (const Header *)map;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION || header->buildIdSize != buildId.size() ||
+        memcmp(header->buildId, buildId.data(), buildId.size()) != 0 || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+        sizeof(Header) + header->capacity * sizeof(Slot) + header->stringsSize != size) {
+      unload();
+      return;
+    }
+    auto table = (const Slot *)(header + 1);
+    for (uint64_t i = 0; i < header->capacity; i++) {
+      if (table[i].hash && (uint64_t)table[i].name + table[i].length > header->stringsSize) {
+        unload();
+        return;
+      }
+    }
+    capacity = header->capacity;
+    slots    = table;
+    strings  = (const char *)(slots + capacity);
+  }
+
+  void unload() {
+    if (map) munmap(map, size);
+    map      = nullptr;
+    size     = 0;
+    slots    = nullptr;
+    strings  = nullptr;
+    capacity = 0;
+  }
+};
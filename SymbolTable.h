@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of the server executable's ELF symbol tables (.symtab and .dynsym).
+struct SymbolTable {
+  void *map        = nullptr;
+  std::size_t size = 0;
+  uintptr_t base   = 0;
+
+  SymbolTable(const char *path = "/proc/self/exe") {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(ElfW(Ehdr))) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        map  = p;
+        size = st.st_size;
+      }
+    }
+    close(fd);
+    if (map && memcmp(map, ELFMAG, SELFMAG) != 0) {
+      munmap(map, size);
+      map = nullptr;
+    }
+    dl_iterate_phdr(
+        [](dl_phdr_info *info, std::size_t, void *data) {
+          *(uintptr_t *)data = info->dlpi_addr;
+          return 1;
+        },
+        &base);
+  }
+  SymbolTable(SymbolTable const &) = delete;
+  SymbolTable &operator=(SymbolTable const &) = delete;
+  ~SymbolTable() {
+    if (map) munmap(map, size);
+  }
+
+  bool valid() const { return map != nullptr; }
+
+  // Calls fn(name, address) for every defined symbol in .symtab and .dynsym.
+  template <typename F> void forEach(F &&fn) const {
+    if (!map) return;
+    auto data = (const char *)map;
+    auto ehdr = (const ElfW(Ehdr) *)data;
+    if (ehdr->e_shoff == 0 || ehdr->e_shoff + (std::size_t)ehdr->e_shnum * sizeof(ElfW(Shdr)) > size) return;
+    auto shdrs = (const ElfW(Shdr) *)(data + ehdr->e_shoff);
+    for (unsigned i = 0; i < ehdr->e_shnum; i++) {
+      auto &sh = shdrs[i];
+      if ((sh.sh_type != SHT_SYMTAB && sh.sh_type != SHT_DYNSYM) || sh.sh_link >= ehdr->e_shnum) continue;
+      auto &strsh = shdrs[sh.sh_link];
+      if (sh.sh_offset + sh.sh_size > size || strsh.sh_offset + strsh.sh_size > size) continue;
+      auto syms    = (const ElfW(Sym) *)(data + sh.sh_offset);
+      auto strtab  = data + strsh.sh_offset;
+      auto count   = sh.sh_size / sizeof(ElfW(Sym));
+      for (std::size_t j = 0; j < count; j++) {
+        auto &sym = syms[j];
+        if (sym.st_shndx == SHN_UNDEF || sym.st_value == 0 || sym.st_name >= strsh.sh_size) continue;
+        auto type = ELF64_ST_TYPE(sym.st_info);
+        if (type != STT_FUNC && type != STT_OBJECT) continue;
+        fn(std::string_view{ strtab + sym.st_name }, (void *)(base + sym.st_value));
+      }
+    }
+  }
+};
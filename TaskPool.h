@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Work-stealing thread pool for CPU-heavy mod work that must not run on the server thread. Each worker owns a deque: it
+// pops its newest task from the back and, once that runs dry, steals the oldest task from the front of another worker.
+//
+// BackgroundTask is opaque to mods, so results cannot be pushed through Scheduler::getCallbackSender(). Continuations
+// registered with submitThenOnMain() are queued here instead and run by runMainCallbacks(), which the mod calls from a
+// hook on the server thread (e.g. Scheduler::processCoroutines).
+struct TaskPool {
+  struct Task {
+    virtual ~Task() {}
+    virtual void run() = 0;
+  };
+  template <typename F> struct TaskImpl : Task {
+    F fn;
+    TaskImpl(F &&fn) : fn(std::move(fn)) {}
+    void run() override { fn(); }
+  };
+  using TaskPtr = std::unique_ptr<Task>;
+
+  struct alignas(64) Worker {
+    std::mutex mtx;
+    std::deque<TaskPtr> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<std::size_t> queued{ 0 };
+  std::atomic<std::size_t> nextWorker{ 0 };
+  std::atomic<bool> stopping{ false };
+  std::mutex sleepMtx;
+  std::condition_variable wake;
+
+  std::mutex mainMtx;
+  std::vector<TaskPtr> mainTasks;
+
+  // Leaves one core for the server thread. hardware_concurrency() may be 0 when unknown.
+  static TaskPool &get() {
+    static TaskPool pool{ std::max(2u, std::thread::hardware_concurrency()) - 1 };
+    return pool;
+  }
+
+  explicit TaskPool(unsigned count) {
+    for (unsigned i = 0; i < count; i++) workers.emplace_back(new Worker);
+    for (unsigned i = 0; i < count; i++) threads.emplace_back([this, i] { loop(i); });
+  }
+  TaskPool(TaskPool const &) = delete;
+  TaskPool &operator=(TaskPool const &) = delete;
+
+  ~TaskPool() {
+    {
+      std::lock_guard lock{ sleepMtx };
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) thread.join();
+  }
+
+  // Runs fn on a worker. Called from a worker it goes onto that worker's own deque, otherwise the deques are used in turn.
+  template <typename F> auto submit(F &&fn) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+    using R = std::invoke_result_t<std::decay_t<F>>;
+    std::packaged_task<R()> task{ std::forward<F>(fn) };
+    auto future = task.get_future();
+    push(makeTask(std::move(task)));
+    return future;
+  }
+
+  // Runs fn on a worker and then then(result) on the server thread, during the next runMainCallbacks(). If fn or then
+  // throws, onError(exception) runs on the server thread instead, as a std::future would rethrow it from get(); the
+  // default reports it on stderr. onError itself must not throw.
+  template <typename F, typename C> void submitThenOnMain(F &&fn, C &&then) { submitThenOnMain(std::forward<F>(fn), std::forward<C>(then), &reportError); }
+  template <typename F, typename C, typename E> void submitThenOnMain(F &&fn, C &&then, E &&onError) {
+    push(makeTask([this, fn = std::forward<F>(fn), then = std::forward<C>(then), onError = std::forward<E>(onError)]() mutable {
+      try {
+        if constexpr (std::is_void_v<std::invoke_result_t<decltype(fn) &>>) {
+          fn();
+          postToMain([then = std::move(then), onError = std::move(onError)]() mutable { guarded(then, onError); });
+        } else
+          // result is captured first, so onError is still ours if fn throws.
+          postToMain([result = fn(), then = std::move(then), onError = std::move(onError)]() mutable {
+            guarded([&] { then(std::move(result)); }, onError);
+          });
+      } catch (...) {
+        postToMain([onError = std::move(onError), error = std::current_exception()]() mutable { onError(error); });
+      }
+    }));
+  }
+
+  template <typename F> void postToMain(F &&fn) {
+    std::lock_guard lock{ mainMtx };
+    mainTasks.push_back(makeTask(std::forward<F>(fn)));
+  }
+
+  // Runs every continuation queued so far. Must be called on the server thread. An exception from a postToMain() task is
+  // reported rather than thrown into the server's caller.
+  std::size_t runMainCallbacks() {
+    std::vector<TaskPtr> batch;
+    {
+      std::lock_guard lock{ mainMtx };
+      if (mainTasks.empty()) return 0;
+      batch.swap(mainTasks);
+    }
+    for (auto &task : batch) guarded([&] { task->run(); }, reportError);
+    return batch.size();
+  }
+
+  static void reportError(std::exception_ptr error) {
+    try {
+      std::rethrow_exception(error);
+    } catch (std::exception const &e) {
+      std::cerr << "[TaskPool] task failed: " << e.what() << std::endl;
+    } catch (...) {
+      std::cerr << "[TaskPool] task failed with a non-standard exception" << std::endl;
+    }
+  }
+
+private:
+  template <typename F, typename E> static void guarded(F &&fn, E &onError) {
+    try {
+      fn();
+    } catch (...) {
+      onError(std::current_exception());
+    }
+  }
+
+  template <typename F> static TaskPtr makeTask(F &&fn) { return TaskPtr{ new TaskImpl<std::decay_t<F>>(std::forward<F>(fn)) }; }
+
+  // The pool and index of the worker running on this thread, if any. A worker of another pool submitting here must not
+  // use its own index.
+  static std::pair<TaskPool const *, unsigned> &currentWorker() {
+    static thread_local std::pair<TaskPool const *, unsigned> worker{ nullptr, 0 };
+    return worker;
+  }
+
+  void push(TaskPtr task) {
+    auto [owner, index] = currentWorker();
+    if (owner != this) index = nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+      std::lock_guard lock{ workers[index]->mtx };
+      workers[index]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard lock{ sleepMtx };
+      queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake.notify_one();
+  }
+
+  TaskPtr pop(unsigned self) {
+    {
+      auto &own = *workers[self];
+      std::lock_guard lock{ own.mtx };
+      if (!own.tasks.empty()) {
+        auto task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return task;
+      }
+    }
+    for (std::size_t i = 1; i < workers.size(); i++) {
+      auto &victim = *workers[(self + i) % workers.size()];
+      std::lock_guard lock{ victim.mtx };
+      if (victim.tasks.empty()) continue;
+      auto task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return task;
+    }
+    return nullptr;
+  }
+
+  void loop(unsigned self) {
+    currentWorker() = { this, self };
+    while (true) {
+      if (auto task = pop(self)) {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        task->run();
+        continue;
+      }
+      std::unique_lock lock{ sleepMtx };
+      wake.wait(lock, [this] { return stopping || queued.load(std::memory_order_relaxed) != 0; });
+      if (stopping) return;
+    }
+  }
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "minecraft/Scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+
+// Server-thread queue for work that may slip to a later tick. The mod calls beginTick() from a hook at the start of the
+// server tick and drain() from one at its end; drain() runs queued items, highest priority first, only while the tick
+// is still inside its budget.
+//
+// While the Scheduler reports starvation the budget is halved for every starved frame and Cosmetic items are held back
+// entirely, so a lagging server catches up before any of it runs again.
+struct TickWorkQueue {
+  using clock = std::chrono::steady_clock;
+  enum class Priority { High, Normal, Cosmetic };
+
+  std::deque<std::function<void()>> queues[3];
+  clock::time_point tickStarted = clock::now();
+  std::chrono::nanoseconds tickLength{ std::chrono::milliseconds(50) };
+  // Left unused at the end of every tick as headroom for the server's own post-tick work.
+  std::chrono::nanoseconds reserve{ std::chrono::milliseconds(5) };
+  std::size_t lastRun      = 0;
+  std::size_t skippedTicks = 0;
+
+  static TickWorkQueue &get() {
+    static TickWorkQueue queue;
+    return queue;
+  }
+
+  void push(std::function<void()> fn, Priority priority = Priority::Normal) { queues[(int)priority].push_back(std::move(fn)); }
+
+  void beginTick() { tickStarted = clock::now(); }
+
+  std::size_t backlog() const { return queues[0].size() + queues[1].size() + queues[2].size(); }
+  std::size_t backlog(Priority priority) const { return queues[(int)priority].size(); }
+
+  // Runs queued work until the remaining budget is used up and returns how many items ran.
+  std::size_t drain(Scheduler &scheduler) {
+    auto budget  = tickLength - reserve;
+    bool starved = scheduler.isStarved();
+    if (starved) budget /= 1 << std::min(scheduler._getNumberOfStarvedFrames(), 8u);
+    auto deadline = tickStarted + budget;
+    lastRun       = 0;
+    for (int priority = 0; priority < (starved ? 2 : 3); priority++) {
+      auto &queue = queues[priority];
+      while (!queue.empty() && clock::now() < deadline) {
+        auto fn = std::move(queue.front());
+        queue.pop_front();
+        fn();
+        lastRun++;
+      }
+    }
+    if (!lastRun && backlog()) skippedTicks++;
+    return lastRun;
+  }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "minecraft/Timer.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hierarchical timer wheel for cooldowns and delayed tasks, counted in server ticks. Four levels of 64 slots cover
+// 2^24 ticks (about 9.7 days at 20 TPS); longer delays are parked in the top level and re-filed when it comes round.
+// after()/every()/cancel() are O(1), and a tick only touches the timers that expire in it plus, every 64^n ticks, one
+// slot of level n whose timers move down a level.
+//
+// The wheel follows the server's Timer, so time scale changes apply to it too: hook Timer::advanceTime, call the
+// original, then follow(*timer). Server thread only; callbacks may add and cancel timers, including their own.
+struct TimerWheel {
+  static constexpr unsigned levelBits = 6;
+  static constexpr unsigned slotCount = 1u << levelBits;
+  static constexpr unsigned levels    = 4;
+
+  struct Handle {
+    std::uint32_t index      = ~0u;
+    std::uint32_t generation = 0;
+    explicit operator bool() const { return index != ~0u; }
+  };
+
+  struct Node {
+    std::function<void()> fn;
+    std::uint64_t deadline   = 0;
+    std::uint32_t period     = 0; // 0 for one-shot timers
+    std::uint32_t generation = 0;
+    std::int32_t prev = -1, next = -1;
+    std::int32_t *slot = nullptr; // list head this node is linked into, null while firing or free
+    bool armed         = false;
+  };
+
+  std::vector<Node> nodes;
+  std::vector<std::uint32_t> freeNodes;
+  std::int32_t slots[levels][slotCount];
+  std::uint64_t now  = 0;
+  std::size_t active = 0;
+
+  TimerWheel() {
+    for (auto &level : slots)
+      for (auto &head : level) head = -1;
+  }
+  TimerWheel(TimerWheel const &) = delete;
+  TimerWheel &operator=(TimerWheel const &) = delete;
+
+  static TimerWheel &get() {
+    static TimerWheel wheel;
+    return wheel;
+  }
+
+  // Runs fn once, `ticks` ticks from now (at least one).
+  Handle after(std::uint32_t ticks, std::function<void()> fn) { return arm(ticks, 0, std::move(fn)); }
+
+  // Runs fn every `period` ticks, first after `delay` ticks (defaults to one period). Each run is scheduled from the
+  // previous deadline, so the rate does not drift.
+  Handle every(std::uint32_t period, std::function<void()> fn, std::uint32_t delay = 0) {
+    if (!period) period = 1;
+    return arm(delay ? delay : period, period, std::move(fn));
+  }
+
+  bool pending(Handle handle) const { return handle.index < nodes.size() && nodes[handle.index].generation == handle.generation && nodes[handle.index].armed; }
+
+  // Ticks left until the timer fires, or 0 if it is no longer pending.
+  std::uint64_t remaining(Handle handle) const { return pending(handle) ? nodes[handle.index].deadline - now : 0; }
+
+  bool cancel(Handle handle) {
+    if (!pending(handle)) return false;
+    auto &node = nodes[handle.index];
+    node.armed = false;
+    // A timer cancelled from its own callback is released once the callback returns.
+    if (node.slot) {
+      unlink(handle.index);
+      release(handle.index);
+    }
+    return true;
+  }
+
+  std::size_t size() const { return active; }
+
+  void advance(std::uint32_t ticks = 1) {
+    while (ticks--) step();
+  }
+
+  // Runs the ticks the server's Timer has just accumulated.
+  void follow(Timer const &timer) { advance(timer.getTicks()); }
+
+private:
+  Handle arm(std::uint32_t delay, std::uint32_t period, std::function<void()> fn) {
+    std::uint32_t index;
+    if (freeNodes.empty()) {
+      index = (std::uint32_t)nodes.size();
+      nodes.emplace_back();
+    } else {
+      index = freeNodes.back();
+      freeNodes.pop_back();
+    }
+    auto &node    = nodes[index];
+    node.fn       = std::move(fn);
+    node.deadline = now + (delay ? delay : 1);
+    node.period   = period;
+    node.armed    = true;
+    active++;
+    file(index);
+    return { index, node.generation };
+  }
+
+  void release(std::uint32_t index) {
+    auto &node = nodes[index];
+    node.fn    = nullptr;
+    node.generation++;
+    freeNodes.push_back(index);
+    active--;
+  }
+
+  // Picks the lowest level whose span covers the remaining delay; the slot is reached no later than the deadline.
+  void file(std::uint32_t index) {
+    auto &node  = nodes[index];
+    auto delta  = node.deadline - now;
+    unsigned level = 0;
+    while (level + 1 < levels && delta >= (std::uint64_t(1) << (levelBits * (level + 1)))) level++;
+    std::uint64_t target = delta >> (levelBits * levels) ? now + ((std::uint64_t(slotCount) - 1) << (levelBits * level)) : node.deadline;
+    link(index, &slots[level][(target >> (levelBits * level)) & (slotCount - 1)]);
+  }
+
+  void link(std::uint32_t index, std::int32_t *head) {
+    auto &node = nodes[index];
+    node.slot  = head;
+    node.prev  = -1;
+    node.next  = *head;
+    if (*head >= 0) nodes[*head].prev = index;
+    *head = index;
+  }
+
+  void unlink(std::uint32_t index) {
+    auto &node = nodes[index];
+    if (node.prev >= 0)
+      nodes[node.prev].next = node.next;
+    else
+      *node.slot = node.next;
+    if (node.next >= 0) nodes[node.next].prev = node.prev;
+    node.slot = nullptr;
+  }
+
+  void step() {
+    now++;
+    // Move the timers of every higher-level slot that comes due down to where their remaining delay belongs.
+    for (unsigned level = 1; level < levels && !(now & ((std::uint64_t(1) << (levelBits * level)) - 1)); level++) {
+      auto &head = slots[level][(now >> (levelBits * level)) & (slotCount - 1)];
+      while (head >= 0) {
+        auto index = head;
+        unlink(index);
+        file(index);
+      }
+    }
+    // New timers are at least a tick away and never land in this slot, so the loop ends.
+    auto &head = slots[0][now & (slotCount - 1)];
+    while (head >= 0) {
+      auto index = head;
+      unlink(index);
+      auto fn = std::move(nodes[index].fn);
+      fn();
+      auto &node = nodes[index]; // fn() may have grown the pool
+      if (node.armed && node.period) {
+        node.fn = std::move(fn);
+        node.deadline += node.period;
+        file(index);
+      } else {
+        node.armed = false;
+        release(index);
+      }
+    }
+  }
+};
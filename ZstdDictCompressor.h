@@ -0,0 +1,312 @@
+#pragma once
+
+#include "minecraft/LevelStorage.h"
+#include <CompressorInstall.h>
+#include <HookChain.h>
+#include <cstdint>
+#include <cstdio>
+#include <dirent.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+#include <zdict.h>
+#include <zstd.h>
+
+// Zstd compressor that primes every block with a dictionary trained on the world's own records. SubChunk records
+// repeat the same palettes and block-state NBT across a world, and a block of a few KiB is too small for zstd to learn
+// them on its own; with a dictionary it can reference them from the first byte.
+//
+// Blocks carry their own SERIALIZE_ID and the dictionary id in the zstd frame. The DB therefore keeps reading blocks
+// written with the server's compressors, and compaction gradually rewrites them with the dictionary. Dictionaries live
+// next to the DB's own files, which leveldb never deletes:
+//   chunks.zdict    the dictionary new blocks are compressed with
+//   <id>.zdict      retired dictionaries, kept so blocks written with them stay readable
+// install() also adds them to DBStorage::createSnapshot()'s file list, so backups carry them along with the tables.
+//
+// A world written with this compressor needs it to be read back: a server without the mod, or without the .zdict files,
+// has no compressor for id 16 and reports those blocks as corrupt. Only remove the mod after a full compaction with it
+// uninstalled has rewritten every block.
+//
+// Train once, e.g. from a mod command while the world runs (the DB allows concurrent reads), then restart:
+//
+//   ZstdDictTrainer{}.train(*storage->db, dbDirectory);
+//   ZstdDictCompressor::install(); // before the level loads, on every start
+//
+// Mods using this link against libzstd; the server's own zstd is not exported.
+struct ZstdDictCompressor : leveldb::Compressor {
+  static const char SERIALIZE_ID = 16; // clear of the ids the server uses (1-4)
+  static constexpr const char *activeName = "chunks.zdict";
+
+  struct Dictionary {
+    unsigned id;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+  };
+
+  int const compressionLevel;
+  std::vector<Dictionary> dictionaries; // the first one compresses; all of them decompress
+
+  explicit ZstdDictCompressor(int compressionLevel = 3) : Compressor(SERIALIZE_ID), compressionLevel(compressionLevel) {}
+  ZstdDictCompressor(ZstdDictCompressor const &) = delete;
+  ZstdDictCompressor &operator=(ZstdDictCompressor const &) = delete;
+
+  ~ZstdDictCompressor() override {
+    for (auto &dict : dictionaries) {
+      ZSTD_freeCDict(dict.cdict);
+      ZSTD_freeDDict(dict.ddict);
+    }
+  }
+
+  // Adds a dictionary built by ZDICT; the first one added is used for compression. Returns its id, or 0 if `bytes` is
+  // not a zstd dictionary or zstd could not digest it.
+  unsigned addDictionary(std::string const &bytes) {
+    auto id = ZDICT_getDictID(bytes.data(), bytes.size());
+    if (!id) return 0;
+    for (auto &dict : dictionaries)
+      if (dict.id == id) return id;
+    auto cdict = ZSTD_createCDict(bytes.data(), bytes.size(), compressionLevel);
+    auto ddict = ZSTD_createDDict(bytes.data(), bytes.size());
+    if (!cdict || !ddict) {
+      ZSTD_freeCDict(cdict);
+      ZSTD_freeDDict(ddict);
+      return 0;
+    }
+    dictionaries.push_back(Dictionary{ id, cdict, ddict });
+    return id;
+  }
+
+  // Loads chunks.zdict and every retired dictionary from `directory`. Returns null if there are none.
+  static std::unique_ptr<ZstdDictCompressor> load(std::string const &directory, int compressionLevel = 3) {
+    auto compressor = std::make_unique<ZstdDictCompressor>(compressionLevel);
+    std::string bytes;
+    if (readFile(directory + '/' + activeName, bytes)) compressor->addDictionary(bytes);
+    if (auto dir = opendir(directory.c_str())) {
+      while (auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == activeName || name.size() <= 6 || name.compare(name.size() - 6, 6, ".zdict")) continue;
+        if (readFile(directory + '/' + name, bytes)) compressor->addDictionary(bytes);
+      }
+      closedir(dir);
+    }
+    if (compressor->dictionaries.empty()) return nullptr;
+    return compressor;
+  }
+
+  bool compresses() const { return !dictionaries.empty(); }
+
+  void compressImpl(const char *input, size_t length, std::string &output) const override {
+    auto &ctx = contexts();
+    output.resize(ZSTD_compressBound(length));
+    auto size = dictionaries.empty() ? ZSTD_compressCCtx(ctx.cctx, &output[0], output.size(), input, length, compressionLevel)
+                                     : ZSTD_compress_usingCDict(ctx.cctx, &output[0], output.size(), input, length, dictionaries.front().cdict);
+    // Within the bound zstd only fails when it cannot allocate; a plain frame still decompresses.
+    if (ZSTD_isError(size)) size = ZSTD_compress(&output[0], output.size(), input, length, compressionLevel);
+    output.resize(size);
+  }
+
+  bool decompress(const char *input, size_t length, std::string &output) const override {
+    auto size = ZSTD_getFrameContentSize(input, length);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) return false;
+    ZSTD_DDict const *ddict = nullptr;
+    if (auto id = ZSTD_getDictID_fromFrame(input, length)) {
+      for (auto &dict : dictionaries)
+        if (dict.id == id) ddict = dict.ddict;
+      if (!ddict) return false; // its dictionary file is gone
+    }
+    output.resize(size);
+    auto &ctx   = contexts();
+    auto result = ddict ? ZSTD_decompress_usingDDict(ctx.dctx, &output[0], size, input, length, ddict) : ZSTD_decompressDCtx(ctx.dctx, &output[0], size, input, length);
+    return !ZSTD_isError(result) && result == size;
+  }
+
+  using CreateSnapshotChain = THookChainFor(_ZN9DBStorage14createSnapshotEv, std::vector<SnapshotFilenameAndLength>(DBStorage *));
+
+  // Adds a compressor for the dictionaries found in each DB's directory when it is opened. With a chunks.zdict it becomes
+  // compressors[0], the one leveldb writes with, unless another mod's compressor already writes (see
+  // attachCompressors()). With only retired dictionaries it just reads.
+  static void install(int compressionLevel = 3) {
+    level() = compressionLevel;
+    void (*attach)(leveldb::Options const *&, std::string const *&, leveldb::DB **&) = [](leveldb::Options const *&options, std::string const *&name, leveldb::DB **&) {
+      auto compressor = forDirectory(*name);
+      if (!compressor) return;
+      if (compressor->compresses())
+        attachCompressors(options, *name, compressor, {});
+      else
+        attachCompressors(options, *name, nullptr, { compressor });
+    };
+    DBOpenChain::get().addRewrite(DBOpenSymbol, 0, (void *)attach);
+    void (*snapshot)(std::vector<SnapshotFilenameAndLength> &, DBStorage *&) = [](std::vector<SnapshotFilenameAndLength> &files, DBStorage *&storage) {
+      addToSnapshot(files, storage->db_path);
+    };
+    CreateSnapshotChain::get().add("_ZN9DBStorage14createSnapshotEv", true, false, 0, (void *)snapshot);
+  }
+
+  // Lists the dictionaries in `directory` after the DB's own files, named the way those are.
+  static void addToSnapshot(std::vector<SnapshotFilenameAndLength> &files, std::string const &directory) {
+    if (files.empty()) return;
+    auto &sample = files.front().str;
+    auto prefix  = sample.substr(0, sample.rfind('/') + 1);
+    auto dir     = opendir(directory.c_str());
+    if (!dir) return;
+    while (auto entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      struct stat info;
+      if (name.size() <= 6 || name.compare(name.size() - 6, 6, ".zdict") || stat((directory + '/' + name).c_str(), &info) != 0) continue;
+      files.emplace_back(prefix + name, (unsigned)info.st_size);
+    }
+    closedir(dir);
+  }
+
+  static bool readFile(std::string const &path, std::string &bytes) {
+    auto file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    bytes.clear();
+    char buffer[65536];
+    std::size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) bytes.append(buffer, read);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+  }
+
+private:
+  struct Contexts {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ~Contexts() {
+      ZSTD_freeCCtx(cctx);
+      ZSTD_freeDCtx(dctx);
+    }
+  };
+
+  // Compression runs on the writer and compaction threads and decompression on every reader, so each thread keeps its
+  // own contexts instead of creating them per block.
+  static Contexts &contexts() {
+    static thread_local Contexts ctx;
+    return ctx;
+  }
+
+  static int &level() {
+    static int value = 3;
+    return value;
+  }
+
+  // The DB keeps raw pointers to its compressors, so every compressor created here lives until exit. A reopened DB gets
+  // the same one back unless its dictionaries changed in between.
+  static ZstdDictCompressor *forDirectory(std::string const &directory) {
+    static std::mutex mutex;
+    static std::vector<std::pair<std::string, std::unique_ptr<ZstdDictCompressor>>> live;
+    auto loaded = load(directory, level());
+    if (!loaded) return nullptr;
+    std::lock_guard lock(mutex);
+    for (auto it = live.rbegin(); it != live.rend(); ++it)
+      if (it->first == directory && sameDictionaries(*it->second, *loaded)) return it->second.get();
+    live.emplace_back(directory, std::move(loaded));
+    return live.back().second.get();
+  }
+
+  static bool sameDictionaries(ZstdDictCompressor const &a, ZstdDictCompressor const &b) {
+    if (a.dictionaries.size() != b.dictionaries.size()) return false;
+    for (std::size_t i = 0; i < a.dictionaries.size(); i++)
+      if (a.dictionaries[i].id != b.dictionaries[i].id) return false;
+    return true;
+  }
+};
+
+// Builds chunks.zdict from a uniform sample of a DB's records. train() walks the whole DB once, keeping a bounded
+// reservoir of records, so it reads every record but holds at most `maxSamples` of them. On a large world, run it while
+// the server is idle. Any previous chunks.zdict is retired to <id>.zdict, so blocks already written with it stay
+// readable.
+struct ZstdDictTrainer {
+  std::size_t dictionarySize = 112640; // zstd's own default
+  std::size_t maxSamples     = 16384;
+  std::size_t maxSampleSize  = 128 << 10; // larger records add little to the dictionary
+  // Bytes kept across all samples; 0 means 100x dictionarySize, the amount zstd recommends training on.
+  std::size_t maxTotalSize = 0;
+  // Which records to learn from; SubChunkPrefix records by default.
+  std::function<bool(leveldb::Slice const &key)> filter = isSubChunk;
+
+  std::vector<std::string> samples;
+  std::size_t totalSize = 0;
+  std::uint64_t seen    = 0;
+  std::mt19937_64 random{ 0x5eed };
+
+  // Chunk keys are x, z[, dimension] as int32 followed by the record tag and, for SubChunkPrefix (47), the subchunk index.
+  static bool isSubChunk(leveldb::Slice const &key) { return (key.size() == 10 || key.size() == 14) && key[key.size() - 2] == 47; }
+
+  std::size_t budget() const { return maxTotalSize ? maxTotalSize : dictionarySize * 100; }
+
+  // Reservoir sampling bounded by both maxSamples and budget(), so every eligible record is about equally likely to be
+  // kept however large the DB is. A replacement that overflows the budget evicts random samples until it fits again.
+  void add(leveldb::Slice const &value) {
+    if (value.size() == 0 || value.size() > maxSampleSize || value.size() > budget()) return;
+    if (samples.size() < maxSamples && totalSize + value.size() <= budget()) {
+      samples.emplace_back(value.data(), value.size());
+      totalSize += value.size();
+    } else if (auto slot = std::uniform_int_distribution<std::uint64_t>(0, seen)(random); slot < samples.size()) {
+      totalSize += value.size() - samples[slot].size();
+      samples[slot].assign(value.data(), value.size());
+      while (totalSize > budget()) {
+        auto victim = std::uniform_int_distribution<std::size_t>(0, samples.size() - 1)(random);
+        totalSize -= samples[victim].size();
+        std::swap(samples[victim], samples.back());
+        samples.pop_back();
+      }
+    }
+    seen++;
+  }
+
+  // Trains on the collected samples and writes the dictionary into `directory`. Returns the new dictionary's id, or 0 on
+  // failure with the reason in `error`.
+  unsigned write(std::string const &directory, std::string *error = nullptr) {
+    std::string joined;
+    std::vector<std::size_t> sizes;
+    joined.reserve(totalSize);
+    for (auto &sample : samples) {
+      joined += sample;
+      sizes.push_back(sample.size());
+    }
+    std::string dictionary(dictionarySize, '\0');
+    auto size = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(), joined.data(), sizes.data(), (unsigned)sizes.size());
+    if (ZDICT_isError(size)) return fail(error, ZDICT_getErrorName(size));
+    dictionary.resize(size);
+    auto id = ZDICT_getDictID(dictionary.data(), dictionary.size());
+
+    auto active = directory + '/' + ZstdDictCompressor::activeName;
+    std::string previous;
+    if (ZstdDictCompressor::readFile(active, previous))
+      if (auto old = ZDICT_getDictID(previous.data(), previous.size())) rename(active.c_str(), (directory + '/' + std::to_string(old) + ".zdict").c_str());
+    auto temp = active + ".tmp";
+    auto file = fopen(temp.c_str(), "wb");
+    if (!file) return fail(error, "cannot create " + temp);
+    bool ok = fwrite(dictionary.data(), 1, dictionary.size(), file) == dictionary.size();
+    ok      = fclose(file) == 0 && ok;
+    if (!ok || rename(temp.c_str(), active.c_str()) != 0) {
+      remove(temp.c_str());
+      return fail(error, "cannot write " + active);
+    }
+    return id;
+  }
+
+  // Samples `db` and writes the dictionary into `directory`, the path the DB was opened with. Takes effect the next time
+  // the DB is opened.
+  unsigned train(leveldb::DB &db, std::string const &directory, std::string *error = nullptr) {
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    std::unique_ptr<leveldb::Iterator> it{ db.NewIterator(options) };
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+      if (filter(it->key())) add(it->value());
+    if (samples.empty()) return fail(error, "no records to train on");
+    return write(directory, error);
+  }
+
+private:
+  static unsigned fail(std::string *error, std::string const &reason) {
+    if (error) *error = reason;
+    return 0;
+  }
+};
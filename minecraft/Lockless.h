@@ -1,16 +1,71 @@
 #pragma once
 
 #include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
 
 namespace Lockless {
 
-template <typename T> struct WeakAtomic {
+// Memory-order policies for WeakAtomic: the order used by loads, by stores and by read-modify-write operations.
+struct Relaxed {
+  static constexpr std::memory_order load  = std::memory_order_relaxed;
+  static constexpr std::memory_order store = std::memory_order_relaxed;
+  static constexpr std::memory_order rmw   = std::memory_order_relaxed;
+};
+struct AcqRel {
+  static constexpr std::memory_order load  = std::memory_order_acquire;
+  static constexpr std::memory_order store = std::memory_order_release;
+  static constexpr std::memory_order rmw   = std::memory_order_acq_rel;
+};
+struct SeqCst {
+  static constexpr std::memory_order load  = std::memory_order_seq_cst;
+  static constexpr std::memory_order store = std::memory_order_seq_cst;
+  static constexpr std::memory_order rmw   = std::memory_order_seq_cst;
+};
+
+// Padding policies: CacheLine gives the atomic a 64-byte line of its own, so a counter written by the tick thread does
+// not invalidate the line holding one written by an IO thread.
+struct NoPadding {
+  static constexpr std::size_t alignment = 0;
+};
+struct CacheLine {
+  static constexpr std::size_t alignment = 64;
+};
+
+// Atomic whose ordering is fixed by its type instead of at every call site. The server's queues use the default,
+// relaxed and unpadded, and order their accesses with explicit fences.
+template <typename T, typename Order = Relaxed, typename Padding = NoPadding> struct alignas(Padding::alignment ? Padding::alignment : alignof(std::atomic<T>)) WeakAtomic {
   std::atomic<T> data;
-  WeakAtomic();
-  template <typename U> WeakAtomic(U &&);
-  T load();
-  operator T();
-  template <typename U> T &operator=(U &&);
+  WeakAtomic() {}
+  // Constrained so a non-const WeakAtomic lvalue picks the deleted copy operations instead of converting through T.
+  template <typename U, typename = std::enable_if_t<!std::is_same_v<std::decay_t<U>, WeakAtomic>>> WeakAtomic(U &&value) : data(std::forward<U>(value)) {}
+  WeakAtomic(WeakAtomic const &) = delete;
+  WeakAtomic &operator=(WeakAtomic const &) = delete;
+
+  T load() const { return data.load(Order::load); }
+  operator T() const { return load(); }
+  void store(T value) { data.store(value, Order::store); }
+  template <typename U, typename = std::enable_if_t<!std::is_same_v<std::decay_t<U>, WeakAtomic>>> T operator=(U &&value) {
+    T stored = std::forward<U>(value);
+    store(stored);
+    return stored;
+  }
+
+  T exchange(T value) { return data.exchange(value, Order::rmw); }
+  bool compare_exchange_weak(T &expected, T desired) { return data.compare_exchange_weak(expected, desired, Order::rmw, Order::load); }
+  bool compare_exchange_strong(T &expected, T desired) { return data.compare_exchange_strong(expected, desired, Order::rmw, Order::load); }
+
+  // Only for integral and pointer T, like the std::atomic members they forward to.
+  template <typename U> T fetch_add(U delta) { return data.fetch_add(delta, Order::rmw); }
+  template <typename U> T fetch_sub(U delta) { return data.fetch_sub(delta, Order::rmw); }
+  T operator++() { return fetch_add(1) + 1; }
+  T operator--() { return fetch_sub(1) - 1; }
+  T operator++(int) { return fetch_add(1); }
+  T operator--(int) { return fetch_sub(1); }
 };
 
-} // namespace Lockless
\ No newline at end of file
+static_assert(sizeof(WeakAtomic<std::size_t>) == sizeof(std::size_t));
+static_assert(sizeof(WeakAtomic<std::size_t, Relaxed, CacheLine>) == 64);
+
+} // namespace Lockless
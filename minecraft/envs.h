@@ -103,4 +103,7 @@ struct CompactionListenerEnv : leveldb::EnvWrapper {
   void setCompactionCallback(std::function<void(CompactionStatus)> const &);
   void notifyStart();
   void notifyComplete();
-};
\ No newline at end of file
+};
+
+static_assert(sizeof(leveldb::EnvWrapper) == 16);
+static_assert(offsetof(CompactionListenerEnv, env) == 16);
\ No newline at end of file
@@ -1,12 +1,24 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
-#include <memory>
-#include <cstddef>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sys/syscall.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
 
+// moodycamel::ConcurrentQueue as built into the server (thread-local exit notification enabled, 32-bit thread ids).
+// Every producer thread owns a sub-queue of fixed-size blocks; consumers pick a sub-queue and claim elements with a
+// fetch_add, so neither side takes a lock. Bodies are inline so mods can instantiate it with their own T.
 namespace moodycamel {
 
 struct ConcurrentQueueDefaultTraits {
@@ -22,6 +34,7 @@ struct ConcurrentQueueDefaultTraits {
   static inline void *malloc(size_t size) { return std::malloc(size); }
   static inline void free(void *ptr) { return std::free(ptr); }
 };
+template <typename T, typename Traits> class ConcurrentQueue;
 struct ProducerToken;
 struct ConsumerToken;
 namespace details {
@@ -30,7 +43,7 @@ struct ConcurrentQueueProducerTypelessBase {
   std::atomic<bool> inactive;
   ProducerToken *token;
 
-  ConcurrentQueueProducerTypelessBase();
+  ConcurrentQueueProducerTypelessBase() : next(nullptr), inactive(false), token(nullptr) {}
 };
 struct ThreadExitListener {
   typedef void (*callback_t)(void *);
@@ -41,88 +54,634 @@ struct ThreadExitListener {
 typedef std::uint32_t thread_id_t;
 static const thread_id_t invalid_thread_id  = 0;
 static const thread_id_t invalid_thread_id2 = 0xFFFFFFFFU;
-static inline thread_id_t thread_id();
+// The server's own definition is inlined into the binary and cannot be called. This uint32 id with 0xFFFFFFFF as its
+// second invalid value is upstream's GetCurrentThreadId() variant, and gettid() is its Linux counterpart: unique among
+// live threads. Implicit producers on a queue the server also enqueues into (e.g. Scheduler's
+// mpmc::Sender<BackgroundTask>) are keyed by this id on the mod's side and by the server's on its own, so a mod thread
+// could share a hash slot with a server thread if the two schemes differ. Mods pushing into server-owned queues should
+// therefore use a ProducerToken, which is not keyed by thread id.
+static inline thread_id_t thread_id() {
+  static thread_local thread_id_t id = static_cast<thread_id_t>(syscall(SYS_gettid));
+  return id;
+}
+
+// Runs the listeners subscribed on a thread when that thread exits. Notifiers are linked in a global list so a queue
+// destroyed on another thread can still unsubscribe its producers.
+class ThreadExitNotifier {
+public:
+  static void subscribe(ThreadExitListener *listener) {
+    auto &notifier = instance();
+    std::lock_guard lock{ mutex() };
+    listener->next = notifier.tail;
+    notifier.tail  = listener;
+  }
+
+  static void unsubscribe(ThreadExitListener *listener) {
+    std::lock_guard lock{ mutex() };
+    for (auto notifier = head(); notifier; notifier = notifier->nextNotifier) {
+      ThreadExitListener **prev = &notifier->tail;
+      for (auto ptr = notifier->tail; ptr != nullptr; ptr = ptr->next) {
+        if (ptr == listener) {
+          *prev = ptr->next;
+          return;
+        }
+        prev = &ptr->next;
+      }
+    }
+  }
+
+private:
+  ThreadExitListener *tail       = nullptr;
+  ThreadExitNotifier *nextNotifier = nullptr;
+
+  ThreadExitNotifier() {
+    std::lock_guard lock{ mutex() };
+    nextNotifier = head();
+    head()       = this;
+  }
+  ~ThreadExitNotifier() {
+    std::lock_guard lock{ mutex() };
+    for (auto it = &head(); *it; it = &(*it)->nextNotifier)
+      if (*it == this) {
+        *it = nextNotifier;
+        break;
+      }
+    for (auto ptr = tail; ptr != nullptr; ptr = ptr->next) ptr->callback(ptr->userData);
+  }
+
+  static ThreadExitNotifier &instance() {
+    static thread_local ThreadExitNotifier notifier;
+    return notifier;
+  }
+  static ThreadExitNotifier *&head() {
+    static ThreadExitNotifier *list = nullptr;
+    return list;
+  }
+  static std::mutex &mutex() {
+    static std::mutex mtx;
+    return mtx;
+  }
+};
+
+template <typename T> struct const_numeric_max {
+  static constexpr T value = std::numeric_limits<T>::is_signed ? (static_cast<T>(1) << (sizeof(T) * CHAR_BIT - 1)) - static_cast<T>(1) : static_cast<T>(-1);
+};
+
+static inline std::uint32_t hash_thread_id(thread_id_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  return h ^ (h >> 16);
+}
+
+template <typename T> static inline bool circular_less_than(T a, T b) {
+  static_assert(std::is_integral<T>::value && !std::numeric_limits<T>::is_signed, "circular_less_than is intended to be used only with unsigned integer types");
+  return static_cast<T>(a - b) > static_cast<T>(static_cast<T>(1) << static_cast<T>(sizeof(T) * CHAR_BIT - 1));
+}
+
+template <typename U> static inline char *align_for(char *ptr) {
+  const std::size_t alignment = alignof(U);
+  return ptr + (alignment - (reinterpret_cast<std::uintptr_t>(ptr) % alignment)) % alignment;
+}
+
+template <typename T> static inline T ceil_to_pow_2(T x) {
+  static_assert(std::is_integral<T>::value && !std::numeric_limits<T>::is_signed, "ceil_to_pow_2 is intended to be used only with unsigned integer types");
+  --x;
+  for (std::size_t i = 1; i < sizeof(T) * CHAR_BIT; i <<= 1) x |= x >> i;
+  return ++x;
+}
+
+template <typename T> static inline void swap_relaxed(std::atomic<T> &left, std::atomic<T> &right) {
+  T temp = left.load(std::memory_order_relaxed);
+  left.store(right.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  right.store(temp, std::memory_order_relaxed);
+}
+
+template <typename T> static inline T const &nomove(T const &x) { return x; }
+
+template <typename It> static inline auto deref_noexcept(It &it) noexcept -> decltype(*it) { return *it; }
 
 } // namespace details
+
+struct ProducerToken {
+  template <typename T, typename Traits> explicit ProducerToken(ConcurrentQueue<T, Traits> &queue);
+
+  ProducerToken(ProducerToken &&other) noexcept : producer(other.producer) {
+    other.producer = nullptr;
+    if (producer != nullptr) producer->token = this;
+  }
+  ProducerToken &operator=(ProducerToken &&other) noexcept {
+    swap(other);
+    return *this;
+  }
+  void swap(ProducerToken &other) noexcept {
+    std::swap(producer, other.producer);
+    if (producer != nullptr) producer->token = this;
+    if (other.producer != nullptr) other.producer->token = &other;
+  }
+  ProducerToken(ProducerToken const &) = delete;
+  ProducerToken &operator=(ProducerToken const &) = delete;
+
+  // False only if the queue failed to allocate a producer for this token.
+  bool valid() const { return producer != nullptr; }
+
+  ~ProducerToken() {
+    if (producer != nullptr) {
+      producer->token = nullptr;
+      producer->inactive.store(true, std::memory_order_release);
+    }
+  }
+
+private:
+  template <typename T, typename Traits> friend class ConcurrentQueue;
+  details::ConcurrentQueueProducerTypelessBase *producer;
+};
+
+struct ConsumerToken {
+  template <typename T, typename Traits> explicit ConsumerToken(ConcurrentQueue<T, Traits> &queue);
+
+  ConsumerToken(ConsumerToken &&other) noexcept
+      : initialOffset(other.initialOffset), lastKnownGlobalOffset(other.lastKnownGlobalOffset), itemsConsumedFromCurrent(other.itemsConsumedFromCurrent),
+        currentProducer(other.currentProducer), desiredProducer(other.desiredProducer) {}
+  ConsumerToken &operator=(ConsumerToken &&other) noexcept {
+    swap(other);
+    return *this;
+  }
+  void swap(ConsumerToken &other) noexcept {
+    std::swap(initialOffset, other.initialOffset);
+    std::swap(lastKnownGlobalOffset, other.lastKnownGlobalOffset);
+    std::swap(itemsConsumedFromCurrent, other.itemsConsumedFromCurrent);
+    std::swap(currentProducer, other.currentProducer);
+    std::swap(desiredProducer, other.desiredProducer);
+  }
+  ConsumerToken(ConsumerToken const &) = delete;
+  ConsumerToken &operator=(ConsumerToken const &) = delete;
+
+private:
+  template <typename T, typename Traits> friend class ConcurrentQueue;
+  std::uint32_t initialOffset;
+  std::uint32_t lastKnownGlobalOffset;
+  std::uint32_t itemsConsumedFromCurrent;
+  details::ConcurrentQueueProducerTypelessBase *currentProducer;
+  details::ConcurrentQueueProducerTypelessBase *desiredProducer;
+};
+
 template <typename T, typename Traits = ConcurrentQueueDefaultTraits> class ConcurrentQueue {
+public:
   typedef ::moodycamel::ProducerToken producer_token_t;
   typedef ::moodycamel::ConsumerToken consumer_token_t;
   typedef typename Traits::index_t index_t;
   typedef typename Traits::size_t size_t;
-  static const size_t BLOCK_SIZE                                               = static_cast<size_t>(Traits::BLOCK_SIZE);
-  static const size_t EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD                   = static_cast<size_t>(Traits::EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD);
-  static const size_t EXPLICIT_INITIAL_INDEX_SIZE                              = static_cast<size_t>(Traits::EXPLICIT_INITIAL_INDEX_SIZE);
-  static const size_t IMPLICIT_INITIAL_INDEX_SIZE                              = static_cast<size_t>(Traits::IMPLICIT_INITIAL_INDEX_SIZE);
-  static const size_t INITIAL_IMPLICIT_PRODUCER_HASH_SIZE                      = static_cast<size_t>(Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE);
-  static const std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = static_cast<std::uint32_t>(Traits::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE);
-  static const size_t MAX_SUBQUEUE_SIZE                                        = (std::numeric_limits<size_t>::max - static_cast<size_t>(Traits::MAX_SUBQUEUE_SIZE) < BLOCK_SIZE) ?
-                                              std::numeric_limits<size_t>::max :
-                                              ((static_cast<size_t>(Traits::MAX_SUBQUEUE_SIZE) + (BLOCK_SIZE - 1)) / BLOCK_SIZE * BLOCK_SIZE);
-  explicit ConcurrentQueue(size_t capacity = 6 * BLOCK_SIZE);
-  ConcurrentQueue(size_t minCapacity, size_t maxExplicitProducers, size_t maxImplicitProducers);
-  ~ConcurrentQueue();
+  static constexpr size_t BLOCK_SIZE                                               = static_cast<size_t>(Traits::BLOCK_SIZE);
+  static constexpr size_t EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD                   = static_cast<size_t>(Traits::EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD);
+  static constexpr size_t EXPLICIT_INITIAL_INDEX_SIZE                              = static_cast<size_t>(Traits::EXPLICIT_INITIAL_INDEX_SIZE);
+  static constexpr size_t IMPLICIT_INITIAL_INDEX_SIZE                              = static_cast<size_t>(Traits::IMPLICIT_INITIAL_INDEX_SIZE);
+  static constexpr size_t INITIAL_IMPLICIT_PRODUCER_HASH_SIZE                      = static_cast<size_t>(Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE);
+  static constexpr std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = static_cast<std::uint32_t>(Traits::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE);
+  static constexpr size_t MAX_SUBQUEUE_SIZE = (details::const_numeric_max<size_t>::value - static_cast<size_t>(Traits::MAX_SUBQUEUE_SIZE) < BLOCK_SIZE) ?
+                                                  details::const_numeric_max<size_t>::value :
+                                                  ((static_cast<size_t>(Traits::MAX_SUBQUEUE_SIZE) + (BLOCK_SIZE - 1)) / BLOCK_SIZE * BLOCK_SIZE);
+
+  static_assert(!std::numeric_limits<size_t>::is_signed && std::is_integral<size_t>::value, "Traits::size_t must be an unsigned integral type");
+  static_assert(!std::numeric_limits<index_t>::is_signed && std::is_integral<index_t>::value, "Traits::index_t must be an unsigned integral type");
+  static_assert(sizeof(index_t) >= sizeof(size_t), "Traits::index_t must be at least as wide as Traits::size_t");
+  static_assert((BLOCK_SIZE > 1) && !(BLOCK_SIZE & (BLOCK_SIZE - 1)), "Traits::BLOCK_SIZE must be a power of 2 (and at least 2)");
+  static_assert((EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD > 1) && !(EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD & (EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD - 1)),
+                "Traits::EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD must be a power of 2 (and greater than 1)");
+  static_assert((EXPLICIT_INITIAL_INDEX_SIZE > 1) && !(EXPLICIT_INITIAL_INDEX_SIZE & (EXPLICIT_INITIAL_INDEX_SIZE - 1)),
+                "Traits::EXPLICIT_INITIAL_INDEX_SIZE must be a power of 2 (and greater than 1)");
+  static_assert((IMPLICIT_INITIAL_INDEX_SIZE > 1) && !(IMPLICIT_INITIAL_INDEX_SIZE & (IMPLICIT_INITIAL_INDEX_SIZE - 1)),
+                "Traits::IMPLICIT_INITIAL_INDEX_SIZE must be a power of 2 (and greater than 1)");
+  static_assert((INITIAL_IMPLICIT_PRODUCER_HASH_SIZE > 1) && !(INITIAL_IMPLICIT_PRODUCER_HASH_SIZE & (INITIAL_IMPLICIT_PRODUCER_HASH_SIZE - 1)),
+                "Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE must be a power of 2 (and greater than 1)");
+
+  // Preallocates enough blocks for `capacity` elements; further blocks are allocated on demand.
+  explicit ConcurrentQueue(size_t capacity = 6 * BLOCK_SIZE)
+      : producerListTail(nullptr), producerCount(0), initialBlockPoolIndex(0), nextExplicitConsumerId(0), globalExplicitConsumerOffset(0) {
+    implicitProducerHashResizeInProgress.clear(std::memory_order_relaxed);
+    populate_initial_implicit_producer_hash();
+    populate_initial_block_list(capacity / BLOCK_SIZE + ((capacity & (BLOCK_SIZE - 1)) == 0 ? 0 : 1));
+  }
+
+  // Preallocates enough blocks that `minCapacity` elements can be enqueued by any mix of the given producers.
+  ConcurrentQueue(size_t minCapacity, size_t maxExplicitProducers, size_t maxImplicitProducers)
+      : producerListTail(nullptr), producerCount(0), initialBlockPoolIndex(0), nextExplicitConsumerId(0), globalExplicitConsumerOffset(0) {
+    implicitProducerHashResizeInProgress.clear(std::memory_order_relaxed);
+    populate_initial_implicit_producer_hash();
+    size_t blocks = (((minCapacity + BLOCK_SIZE - 1) / BLOCK_SIZE) - 1) * (maxExplicitProducers + 1) + 2 * (maxExplicitProducers + maxImplicitProducers);
+    populate_initial_block_list(blocks);
+  }
+
+  // Not thread-safe: no other thread may be using the queue.
+  ~ConcurrentQueue() {
+    auto ptr = producerListTail.load(std::memory_order_relaxed);
+    while (ptr != nullptr) {
+      auto next = ptr->next_prod();
+      if (ptr->token != nullptr) ptr->token->producer = nullptr;
+      destroy(ptr);
+      ptr = next;
+    }
+
+    // The last hash is part of this object and was not allocated dynamically.
+    auto hash = implicitProducerHash.load(std::memory_order_relaxed);
+    while (hash != nullptr) {
+      auto prev = hash->prev;
+      if (prev != nullptr) {
+        for (size_t i = 0; i != hash->capacity; ++i) hash->entries[i].~ImplicitProducerKVP();
+        hash->~ImplicitProducerHash();
+        (Traits::free)(hash);
+      }
+      hash = prev;
+    }
+
+    auto block = freeList.head_unsafe();
+    while (block != nullptr) {
+      auto next = block->freeListNext.load(std::memory_order_relaxed);
+      if (block->dynamicallyAllocated) destroy(block);
+      block = next;
+    }
+
+    destroy_array(initialBlockPool, initialBlockPoolSize);
+  }
+
   ConcurrentQueue(ConcurrentQueue const &) = delete;
   ConcurrentQueue &operator=(ConcurrentQueue const &) = delete;
-  ConcurrentQueue(ConcurrentQueue &&other) noexcept;
-  inline ConcurrentQueue &operator=(ConcurrentQueue &&other) noexcept;
-  inline void swap(ConcurrentQueue &other) noexcept;
-  ConcurrentQueue &swap_internal(ConcurrentQueue &other);
-  inline bool enqueue(T const &item);
-  inline bool enqueue(T &&item);
-  inline bool enqueue(producer_token_t const &token, T const &item);
-  inline bool enqueue(producer_token_t const &token, T &&item);
-  template <typename It> bool enqueue_bulk(It itemFirst, size_t count);
-  template <typename It> bool enqueue_bulk(producer_token_t const &token, It itemFirst, size_t count);
-  inline bool try_enqueue(T const &item);
-  inline bool try_enqueue(T &&item);
-  inline bool try_enqueue(producer_token_t const &token, T const &item);
-  inline bool try_enqueue(producer_token_t const &token, T &&item);
-  template <typename It> bool try_enqueue_bulk(It itemFirst, size_t count);
-  template <typename It> bool try_enqueue_bulk(producer_token_t const &token, It itemFirst, size_t count);
-  template <typename U> bool try_dequeue(U &item);
-  template <typename U> bool try_dequeue_non_interleaved(U &item);
-  template <typename U> bool try_dequeue(consumer_token_t &token, U &item);
-  template <typename It> size_t try_dequeue_bulk(It itemFirst, size_t max);
-  template <typename It> size_t try_dequeue_bulk(consumer_token_t &token, It itemFirst, size_t max);
-  template <typename U> inline bool try_dequeue_from_producer(producer_token_t const &producer, U &item);
-  template <typename It> inline size_t try_dequeue_bulk_from_producer(producer_token_t const &producer, It itemFirst, size_t max);
-  size_t size_approx() const;
-  static bool is_lock_free();
+
+  // Not thread-safe; leaves `other` as an empty queue.
+  ConcurrentQueue(ConcurrentQueue &&other) noexcept
+      : producerListTail(other.producerListTail.load(std::memory_order_relaxed)), producerCount(other.producerCount.load(std::memory_order_relaxed)),
+        initialBlockPoolIndex(other.initialBlockPoolIndex.load(std::memory_order_relaxed)), initialBlockPool(other.initialBlockPool),
+        initialBlockPoolSize(other.initialBlockPoolSize), freeList(std::move(other.freeList)),
+        nextExplicitConsumerId(other.nextExplicitConsumerId.load(std::memory_order_relaxed)),
+        globalExplicitConsumerOffset(other.globalExplicitConsumerOffset.load(std::memory_order_relaxed)) {
+    implicitProducerHashResizeInProgress.clear(std::memory_order_relaxed);
+    populate_initial_implicit_producer_hash();
+    swap_implicit_producer_hashes(other);
+
+    other.producerListTail.store(nullptr, std::memory_order_relaxed);
+    other.producerCount.store(0, std::memory_order_relaxed);
+    other.nextExplicitConsumerId.store(0, std::memory_order_relaxed);
+    other.globalExplicitConsumerOffset.store(0, std::memory_order_relaxed);
+    other.initialBlockPoolIndex.store(0, std::memory_order_relaxed);
+    other.initialBlockPoolSize = 0;
+    other.initialBlockPool     = nullptr;
+
+    reown_producers();
+  }
+
+  inline ConcurrentQueue &operator=(ConcurrentQueue &&other) noexcept { return swap_internal(other); }
+
+  // Not thread-safe. Tokens stay bound to the queue object they were created for, not to its contents.
+  inline void swap(ConcurrentQueue &other) noexcept { swap_internal(other); }
+
+  ConcurrentQueue &swap_internal(ConcurrentQueue &other) {
+    if (this == &other) return *this;
+    details::swap_relaxed(producerListTail, other.producerListTail);
+    details::swap_relaxed(producerCount, other.producerCount);
+    details::swap_relaxed(initialBlockPoolIndex, other.initialBlockPoolIndex);
+    std::swap(initialBlockPool, other.initialBlockPool);
+    std::swap(initialBlockPoolSize, other.initialBlockPoolSize);
+    freeList.swap(other.freeList);
+    details::swap_relaxed(nextExplicitConsumerId, other.nextExplicitConsumerId);
+    details::swap_relaxed(globalExplicitConsumerOffset, other.globalExplicitConsumerOffset);
+    swap_implicit_producer_hashes(other);
+    reown_producers();
+    other.reown_producers();
+    return *this;
+  }
+
+  // Enqueues through this thread's implicit producer, allocating a block if needed. Fails only if allocation fails or
+  // MAX_SUBQUEUE_SIZE would be exceeded.
+  inline bool enqueue(T const &item) { return inner_enqueue<CanAlloc>(item); }
+  inline bool enqueue(T &&item) { return inner_enqueue<CanAlloc>(std::move(item)); }
+  inline bool enqueue(producer_token_t const &token, T const &item) { return inner_enqueue<CanAlloc>(token, item); }
+  inline bool enqueue(producer_token_t const &token, T &&item) { return inner_enqueue<CanAlloc>(token, std::move(item)); }
+  // Wrap the iterator in std::make_move_iterator to move the elements instead of copying them.
+  template <typename It> bool enqueue_bulk(It itemFirst, size_t count) { return inner_enqueue_bulk<CanAlloc>(itemFirst, count); }
+  template <typename It> bool enqueue_bulk(producer_token_t const &token, It itemFirst, size_t count) {
+    return inner_enqueue_bulk<CanAlloc>(token, itemFirst, count);
+  }
+
+  // The try_ variants never allocate and fail when the preallocated blocks are used up.
+  inline bool try_enqueue(T const &item) { return inner_enqueue<CannotAlloc>(item); }
+  inline bool try_enqueue(T &&item) { return inner_enqueue<CannotAlloc>(std::move(item)); }
+  inline bool try_enqueue(producer_token_t const &token, T const &item) { return inner_enqueue<CannotAlloc>(token, item); }
+  inline bool try_enqueue(producer_token_t const &token, T &&item) { return inner_enqueue<CannotAlloc>(token, std::move(item)); }
+  template <typename It> bool try_enqueue_bulk(It itemFirst, size_t count) { return inner_enqueue_bulk<CannotAlloc>(itemFirst, count); }
+  template <typename It> bool try_enqueue_bulk(producer_token_t const &token, It itemFirst, size_t count) {
+    return inner_enqueue_bulk<CannotAlloc>(token, itemFirst, count);
+  }
+
+  // Dequeues from the fullest of the first few non-empty sub-queues, then falls back to trying every producer.
+  template <typename U> bool try_dequeue(U &item) {
+    size_t nonEmptyCount = 0;
+    ProducerBase *best   = nullptr;
+    size_t bestSize      = 0;
+    for (auto ptr = producerListTail.load(std::memory_order_acquire); nonEmptyCount < 3 && ptr != nullptr; ptr = ptr->next_prod()) {
+      auto size = ptr->size_approx();
+      if (size > 0) {
+        if (size > bestSize) {
+          bestSize = size;
+          best     = ptr;
+        }
+        ++nonEmptyCount;
+      }
+    }
+
+    if (nonEmptyCount > 0) {
+      if (__builtin_expect(best->dequeue(item), 1)) return true;
+      for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod())
+        if (ptr != best && ptr->dequeue(item)) return true;
+    }
+    return false;
+  }
+
+  // Tries every producer in turn; cheaper than try_dequeue when there is only one producer.
+  template <typename U> bool try_dequeue_non_interleaved(U &item) {
+    for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod())
+      if (ptr->dequeue(item)) return true;
+    return false;
+  }
+
+  // Consumers with a token stay on one producer for EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE items, then all
+  // consumers rotate together so they spread over the producers instead of contending on one.
+  template <typename U> bool try_dequeue(consumer_token_t &token, U &item) {
+    if (token.desiredProducer == nullptr || token.lastKnownGlobalOffset != globalExplicitConsumerOffset.load(std::memory_order_relaxed))
+      if (!update_current_producer_after_rotation(token)) return false;
+
+    if (static_cast<ProducerBase *>(token.currentProducer)->dequeue(item)) {
+      if (++token.itemsConsumedFromCurrent == EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE)
+        globalExplicitConsumerOffset.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    auto tail = producerListTail.load(std::memory_order_acquire);
+    auto ptr  = static_cast<ProducerBase *>(token.currentProducer)->next_prod();
+    if (ptr == nullptr) ptr = tail;
+    while (ptr != static_cast<ProducerBase *>(token.currentProducer)) {
+      if (ptr->dequeue(item)) {
+        token.currentProducer          = ptr;
+        token.itemsConsumedFromCurrent = 1;
+        return true;
+      }
+      ptr = ptr->next_prod();
+      if (ptr == nullptr) ptr = tail;
+    }
+    return false;
+  }
+
+  template <typename It> size_t try_dequeue_bulk(It itemFirst, size_t max) {
+    size_t count = 0;
+    for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod()) {
+      count += ptr->dequeue_bulk(itemFirst, max - count);
+      if (count == max) break;
+    }
+    return count;
+  }
+
+  template <typename It> size_t try_dequeue_bulk(consumer_token_t &token, It itemFirst, size_t max) {
+    if (token.desiredProducer == nullptr || token.lastKnownGlobalOffset != globalExplicitConsumerOffset.load(std::memory_order_relaxed))
+      if (!update_current_producer_after_rotation(token)) return 0;
+
+    size_t count = static_cast<ProducerBase *>(token.currentProducer)->dequeue_bulk(itemFirst, max);
+    if (count == max) {
+      if ((token.itemsConsumedFromCurrent += static_cast<std::uint32_t>(max)) >= EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE)
+        globalExplicitConsumerOffset.fetch_add(1, std::memory_order_relaxed);
+      return max;
+    }
+    token.itemsConsumedFromCurrent += static_cast<std::uint32_t>(count);
+    max -= count;
+
+    auto tail = producerListTail.load(std::memory_order_acquire);
+    auto ptr  = static_cast<ProducerBase *>(token.currentProducer)->next_prod();
+    if (ptr == nullptr) ptr = tail;
+    while (ptr != static_cast<ProducerBase *>(token.currentProducer)) {
+      auto dequeued = ptr->dequeue_bulk(itemFirst, max);
+      count += dequeued;
+      if (dequeued != 0) {
+        token.currentProducer          = ptr;
+        token.itemsConsumedFromCurrent = static_cast<std::uint32_t>(dequeued);
+      }
+      if (dequeued == max) break;
+      max -= dequeued;
+      ptr = ptr->next_prod();
+      if (ptr == nullptr) ptr = tail;
+    }
+    return count;
+  }
+
+  template <typename U> inline bool try_dequeue_from_producer(producer_token_t const &producer, U &item) {
+    return static_cast<ExplicitProducer *>(producer.producer)->dequeue(item);
+  }
+
+  template <typename It> inline size_t try_dequeue_bulk_from_producer(producer_token_t const &producer, It itemFirst, size_t max) {
+    return static_cast<ExplicitProducer *>(producer.producer)->dequeue_bulk(itemFirst, max);
+  }
+
+  // Exact only when no other thread is using the queue.
+  size_t size_approx() const {
+    size_t size = 0;
+    for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod()) size += ptr->size_approx();
+    return size;
+  }
+
+  static bool is_lock_free() {
+    return std::atomic<bool>::is_always_lock_free && std::atomic<size_t>::is_always_lock_free && std::atomic<std::uint32_t>::is_always_lock_free &&
+           std::atomic<index_t>::is_always_lock_free && std::atomic<void *>::is_always_lock_free &&
+           std::atomic<details::thread_id_t>::is_always_lock_free;
+  }
+
+private:
+  friend struct ProducerToken;
+  friend struct ConsumerToken;
+
   enum AllocationMode { CanAlloc, CannotAlloc };
-  template <AllocationMode canAlloc, typename U> inline bool inner_enqueue(producer_token_t const &token, U &&element);
-  template <AllocationMode canAlloc, typename U> inline bool inner_enqueue(U &&element);
-  template <AllocationMode canAlloc, typename It> inline bool inner_enqueue_bulk(producer_token_t const &token, It itemFirst, size_t count);
-  template <AllocationMode canAlloc, typename It> inline bool inner_enqueue_bulk(It itemFirst, size_t count);
-  inline bool update_current_producer_after_rotation(consumer_token_t &token);
+
+  template <AllocationMode canAlloc, typename U> inline bool inner_enqueue(producer_token_t const &token, U &&element) {
+    return static_cast<ExplicitProducer *>(token.producer)->ConcurrentQueue::ExplicitProducer::template enqueue<canAlloc>(std::forward<U>(element));
+  }
+
+  template <AllocationMode canAlloc, typename U> inline bool inner_enqueue(U &&element) {
+    auto producer = get_or_add_implicit_producer();
+    return producer == nullptr ? false : producer->ConcurrentQueue::ImplicitProducer::template enqueue<canAlloc>(std::forward<U>(element));
+  }
+
+  template <AllocationMode canAlloc, typename It> inline bool inner_enqueue_bulk(producer_token_t const &token, It itemFirst, size_t count) {
+    return static_cast<ExplicitProducer *>(token.producer)->ConcurrentQueue::ExplicitProducer::template enqueue_bulk<canAlloc>(itemFirst, count);
+  }
+
+  template <AllocationMode canAlloc, typename It> inline bool inner_enqueue_bulk(It itemFirst, size_t count) {
+    auto producer = get_or_add_implicit_producer();
+    return producer == nullptr ? false : producer->ConcurrentQueue::ImplicitProducer::template enqueue_bulk<canAlloc>(itemFirst, count);
+  }
+
+  inline bool update_current_producer_after_rotation(consumer_token_t &token) {
+    auto tail = producerListTail.load(std::memory_order_acquire);
+    if (token.desiredProducer == nullptr && tail == nullptr) return false;
+    auto prodCount    = producerCount.load(std::memory_order_relaxed);
+    auto globalOffset = globalExplicitConsumerOffset.load(std::memory_order_relaxed);
+    if (__builtin_expect(token.desiredProducer == nullptr, 0)) {
+      // First dequeue with this token: start at its own slot, counted from the head of the producer list.
+      std::uint32_t offset  = prodCount - 1 - (token.initialOffset % prodCount);
+      token.desiredProducer = tail;
+      for (std::uint32_t i = 0; i != offset; ++i) {
+        token.desiredProducer = static_cast<ProducerBase *>(token.desiredProducer)->next_prod();
+        if (token.desiredProducer == nullptr) token.desiredProducer = tail;
+      }
+    }
+
+    std::uint32_t delta = globalOffset - token.lastKnownGlobalOffset;
+    if (delta >= prodCount) delta = delta % prodCount;
+    for (std::uint32_t i = 0; i != delta; ++i) {
+      token.desiredProducer = static_cast<ProducerBase *>(token.desiredProducer)->next_prod();
+      if (token.desiredProducer == nullptr) token.desiredProducer = tail;
+    }
+
+    token.lastKnownGlobalOffset    = globalOffset;
+    token.currentProducer          = token.desiredProducer;
+    token.itemsConsumedFromCurrent = 0;
+    return true;
+  }
+
   template <typename N> struct FreeListNode {
-    FreeListNode();
+    FreeListNode() : freeListRefs(0), freeListNext(nullptr) {}
     std::atomic<std::uint32_t> freeListRefs;
     std::atomic<N *> freeListNext;
   };
+
+  // Lock-free free list of blocks. A node's refcount keeps it from being re-added while another thread is still
+  // reading its next pointer in try_get.
   template <typename N> struct FreeList {
-    FreeList();
-    FreeList(FreeList &&other);
-    void swap(FreeList &other);
-    FreeList(FreeList const &) noexcept;
-    FreeList &operator=(FreeList const &) noexcept;
-    inline void add(N *node);
-    inline N *try_get();
-    N *head_unsafe() const;
-    inline void add_knowing_refcount_is_zero(N *node);
+    FreeList() : freeListHead(nullptr) {}
+    FreeList(FreeList &&other) : freeListHead(other.freeListHead.load(std::memory_order_relaxed)) { other.freeListHead.store(nullptr, std::memory_order_relaxed); }
+    void swap(FreeList &other) { details::swap_relaxed(freeListHead, other.freeListHead); }
+    FreeList(FreeList const &) = delete;
+    FreeList &operator=(FreeList const &) = delete;
+
+    inline void add(N *node) {
+      // The should-be-on-freelist bit is known to be 0 here, so a fetch_add sets it.
+      if (node->freeListRefs.fetch_add(SHOULD_BE_ON_FREELIST, std::memory_order_acq_rel) == 0) add_knowing_refcount_is_zero(node);
+    }
+
+    inline N *try_get() {
+      auto head = freeListHead.load(std::memory_order_acquire);
+      while (head != nullptr) {
+        auto prevHead = head;
+        auto refs     = head->freeListRefs.load(std::memory_order_relaxed);
+        if ((refs & REFS_MASK) == 0 || !head->freeListRefs.compare_exchange_strong(refs, refs + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+          head = freeListHead.load(std::memory_order_acquire);
+          continue;
+        }
+
+        // Holding a reference, so next cannot change before the CAS.
+        auto next = head->freeListNext.load(std::memory_order_relaxed);
+        if (freeListHead.compare_exchange_strong(head, next, std::memory_order_acquire, std::memory_order_relaxed)) {
+          assert((head->freeListRefs.load(std::memory_order_relaxed) & SHOULD_BE_ON_FREELIST) == 0);
+          // Drop our reference and the list's.
+          head->freeListRefs.fetch_sub(2, std::memory_order_release);
+          return head;
+        }
+
+        // The head changed under us; drop our reference, re-adding the node if it was freed meanwhile.
+        refs = prevHead->freeListRefs.fetch_sub(1, std::memory_order_acq_rel);
+        if (refs == SHOULD_BE_ON_FREELIST + 1) add_knowing_refcount_is_zero(prevHead);
+      }
+      return nullptr;
+    }
+
+    // Only safe without contention, e.g. when destroying the remaining nodes.
+    N *head_unsafe() const { return freeListHead.load(std::memory_order_relaxed); }
+
+    inline void add_knowing_refcount_is_zero(N *node) {
+      // Nobody else can raise a zero refcount, so next can be written freely. If the CAS fails, the add is left to
+      // whichever thread brings the refcount back to zero (which may be us, hence the loop).
+      auto head = freeListHead.load(std::memory_order_relaxed);
+      while (true) {
+        node->freeListNext.store(head, std::memory_order_relaxed);
+        node->freeListRefs.store(1, std::memory_order_release);
+        if (!freeListHead.compare_exchange_strong(head, node, std::memory_order_release, std::memory_order_relaxed)) {
+          if (node->freeListRefs.fetch_add(SHOULD_BE_ON_FREELIST - 1, std::memory_order_release) == 1) continue;
+        }
+        return;
+      }
+    }
+
     std::atomic<N *> freeListHead;
-    static const std::uint32_t REFS_MASK             = 0x7FFFFFFF;
-    static const std::uint32_t SHOULD_BE_ON_FREELIST = 0x80000000;
+    static constexpr std::uint32_t REFS_MASK             = 0x7FFFFFFF;
+    static constexpr std::uint32_t SHOULD_BE_ON_FREELIST = 0x80000000;
   };
+
   enum InnerQueueContext { implicit_context = 0, explicit_context = 1 };
+
   struct Block {
-    Block();
-    template <InnerQueueContext context> inline bool is_empty() const;
-    template <InnerQueueContext context> inline bool set_empty(index_t i);
-    template <InnerQueueContext context> inline bool set_many_empty(index_t i, size_t count);
-    template <InnerQueueContext context> inline void set_all_empty();
-    template <InnerQueueContext context> inline void reset_empty();
-    inline T *operator[](index_t idx) noexcept;
-    inline T const *operator[](index_t idx) const;
+    Block() : next(nullptr), elementsCompletelyDequeued(0), freeListRefs(0), freeListNext(nullptr), shouldBeOnFreeList(false), dynamicallyAllocated(true) {}
+
+    // Explicit producers track emptiness per slot, implicit ones with a counter.
+    template <InnerQueueContext context> inline bool is_empty() const {
+      if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
+        for (size_t i = 0; i < BLOCK_SIZE; ++i)
+          if (!emptyFlags[i].load(std::memory_order_relaxed)) return false;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+      }
+      if (elementsCompletelyDequeued.load(std::memory_order_relaxed) == BLOCK_SIZE) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+      }
+      assert(elementsCompletelyDequeued.load(std::memory_order_relaxed) <= BLOCK_SIZE);
+      return false;
+    }
+
+    // Returns true if the block is now empty (never in explicit context).
+    template <InnerQueueContext context> inline bool set_empty(index_t i) {
+      if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
+        assert(!emptyFlags[BLOCK_SIZE - 1 - static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1))].load(std::memory_order_relaxed));
+        emptyFlags[BLOCK_SIZE - 1 - static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1))].store(true, std::memory_order_release);
+        return false;
+      }
+      auto prevVal = elementsCompletelyDequeued.fetch_add(1, std::memory_order_release);
+      assert(prevVal < BLOCK_SIZE);
+      return prevVal == BLOCK_SIZE - 1;
+    }
+
+    // Marks count contiguous slots starting at i (no wrapping, count > 0) as empty.
+    template <InnerQueueContext context> inline bool set_many_empty(index_t i, size_t count) {
+      if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
+        std::atomic_thread_fence(std::memory_order_release);
+        i = BLOCK_SIZE - 1 - static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1)) - count + 1;
+        for (size_t j = 0; j != count; ++j) {
+          assert(!emptyFlags[i + j].load(std::memory_order_relaxed));
+          emptyFlags[i + j].store(true, std::memory_order_relaxed);
+        }
+        return false;
+      }
+      auto prevVal = elementsCompletelyDequeued.fetch_add(count, std::memory_order_release);
+      assert(prevVal + count <= BLOCK_SIZE);
+      return prevVal + count == BLOCK_SIZE;
+    }
+
+    template <InnerQueueContext context> inline void set_all_empty() {
+      if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD)
+        for (size_t i = 0; i != BLOCK_SIZE; ++i) emptyFlags[i].store(true, std::memory_order_relaxed);
+      else
+        elementsCompletelyDequeued.store(BLOCK_SIZE, std::memory_order_relaxed);
+    }
+
+    template <InnerQueueContext context> inline void reset_empty() {
+      if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD)
+        for (size_t i = 0; i != BLOCK_SIZE; ++i) emptyFlags[i].store(false, std::memory_order_relaxed);
+      else
+        elementsCompletelyDequeued.store(0, std::memory_order_relaxed);
+    }
+
+    inline T *operator[](index_t idx) noexcept {
+      return static_cast<T *>(static_cast<void *>(elements)) + static_cast<size_t>(idx & static_cast<index_t>(BLOCK_SIZE - 1));
+    }
+    inline T const *operator[](index_t idx) const {
+      return static_cast<T const *>(static_cast<void const *>(elements)) + static_cast<size_t>(idx & static_cast<index_t>(BLOCK_SIZE - 1));
+    }
+
     union {
       char elements[sizeof(T) * BLOCK_SIZE];
       std::max_align_t dummy;
@@ -136,29 +695,427 @@ template <typename T, typename Traits = ConcurrentQueueDefaultTraits> class Conc
     bool dynamicallyAllocated;
   };
   struct MemStats;
+
   struct ProducerBase : details::ConcurrentQueueProducerTypelessBase {
-    ProducerBase(ConcurrentQueue *parent, bool isExplicit);
-    virtual ~ProducerBase();
-    template <typename U> inline bool dequeue(U &element);
-    template <typename It> inline size_t dequeue_bulk(It &itemFirst, size_t max);
-    inline ProducerBase *next_prod() const;
-    inline size_t size_approx() const;
-    inline index_t getTail() const;
+    ProducerBase(ConcurrentQueue *parent, bool isExplicit)
+        : tailIndex(0), headIndex(0), dequeueOptimisticCount(0), dequeueOvercommit(0), tailBlock(nullptr), isExplicit(isExplicit), parent(parent) {}
+    virtual ~ProducerBase() {}
+
+    template <typename U> inline bool dequeue(U &element) {
+      if (isExplicit) return static_cast<ExplicitProducer *>(this)->dequeue(element);
+      return static_cast<ImplicitProducer *>(this)->dequeue(element);
+    }
+
+    template <typename It> inline size_t dequeue_bulk(It &itemFirst, size_t max) {
+      if (isExplicit) return static_cast<ExplicitProducer *>(this)->dequeue_bulk(itemFirst, max);
+      return static_cast<ImplicitProducer *>(this)->dequeue_bulk(itemFirst, max);
+    }
+
+    inline ProducerBase *next_prod() const { return static_cast<ProducerBase *>(next); }
+
+    inline size_t size_approx() const {
+      auto tail = tailIndex.load(std::memory_order_relaxed);
+      auto head = headIndex.load(std::memory_order_relaxed);
+      return details::circular_less_than(head, tail) ? static_cast<size_t>(tail - head) : 0;
+    }
+
+    inline index_t getTail() const { return tailIndex.load(std::memory_order_relaxed); }
+
     std::atomic<index_t> tailIndex;
     std::atomic<index_t> headIndex;
+    // Consumers bump dequeueOptimisticCount before they know an element is there and dequeueOvercommit when it
+    // was not, so their difference is the number of elements actually claimed.
     std::atomic<index_t> dequeueOptimisticCount;
     std::atomic<index_t> dequeueOvercommit;
     Block *tailBlock;
     bool isExplicit;
     ConcurrentQueue *parent;
   };
+
+  // Sub-queue of a ProducerToken: a circular list of blocks the producer keeps reusing, with a circular index of
+  // block base positions for consumers.
   struct ExplicitProducer : public ProducerBase {
-    explicit ExplicitProducer(ConcurrentQueue *parent);
-    ~ExplicitProducer();
-    template <AllocationMode allocMode, typename U> inline bool enqueue(U &&element);
-    template <typename U> bool dequeue(U &element);
-    template <AllocationMode allocMode, typename It> bool enqueue_bulk(It itemFirst, size_t count);
-    template <typename It> size_t dequeue_bulk(It &itemFirst, size_t max);
+    explicit ExplicitProducer(ConcurrentQueue *parent)
+        : ProducerBase(parent, true), blockIndex(nullptr), pr_blockIndexSlotsUsed(0), pr_blockIndexSize(EXPLICIT_INITIAL_INDEX_SIZE >> 1), pr_blockIndexFront(0),
+          pr_blockIndexEntries(nullptr), pr_blockIndexRaw(nullptr) {
+      size_t poolBasedIndexSize = details::ceil_to_pow_2(parent->initialBlockPoolSize) >> 1;
+      if (poolBasedIndexSize > pr_blockIndexSize) pr_blockIndexSize = poolBasedIndexSize;
+      new_block_index(0);
+    }
+
+    ~ExplicitProducer() {
+      // All operations have finished, so every element is either fully dequeued or not at all.
+      if (this->tailBlock != nullptr) {
+        Block *halfDequeuedBlock = nullptr;
+        if ((this->headIndex.load(std::memory_order_relaxed) & static_cast<index_t>(BLOCK_SIZE - 1)) != 0) {
+          size_t i = (pr_blockIndexFront - pr_blockIndexSlotsUsed) & (pr_blockIndexSize - 1);
+          while (details::circular_less_than<index_t>(pr_blockIndexEntries[i].base + BLOCK_SIZE, this->headIndex.load(std::memory_order_relaxed)))
+            i = (i + 1) & (pr_blockIndexSize - 1);
+          assert(details::circular_less_than<index_t>(pr_blockIndexEntries[i].base, this->headIndex.load(std::memory_order_relaxed)));
+          halfDequeuedBlock = pr_blockIndexEntries[i].block;
+        }
+
+        auto block = this->tailBlock;
+        do {
+          block = block->next;
+          if (block->ConcurrentQueue::Block::template is_empty<explicit_context>()) continue;
+
+          size_t i = 0;
+          if (block == halfDequeuedBlock) i = static_cast<size_t>(this->headIndex.load(std::memory_order_relaxed) & static_cast<index_t>(BLOCK_SIZE - 1));
+
+          auto tail           = this->tailIndex.load(std::memory_order_relaxed) & static_cast<index_t>(BLOCK_SIZE - 1);
+          auto lastValidIndex = tail == 0 ? BLOCK_SIZE : static_cast<size_t>(tail);
+          while (i != BLOCK_SIZE && (block != this->tailBlock || i != lastValidIndex)) (*block)[i++]->~T();
+        } while (block != this->tailBlock);
+      }
+
+      if (this->tailBlock != nullptr) {
+        auto block = this->tailBlock;
+        do {
+          auto nextBlock = block->next;
+          if (block->dynamicallyAllocated)
+            destroy(block);
+          else
+            this->parent->add_block_to_free_list(block);
+          block = nextBlock;
+        } while (block != this->tailBlock);
+      }
+
+      auto header = static_cast<BlockIndexHeader *>(pr_blockIndexRaw);
+      while (header != nullptr) {
+        auto prev = static_cast<BlockIndexHeader *>(header->prev);
+        header->~BlockIndexHeader();
+        (Traits::free)(header);
+        header = prev;
+      }
+    }
+
+    template <AllocationMode allocMode, typename U> inline bool enqueue(U &&element) {
+      constexpr bool nothrow   = std::is_nothrow_constructible<T, U &&>::value;
+      index_t currentTailIndex = this->tailIndex.load(std::memory_order_relaxed);
+      index_t newTailIndex     = 1 + currentTailIndex;
+      if ((currentTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) == 0) {
+        // End of a block: reuse the next one if consumers have emptied it, otherwise link in a new one.
+        auto startBlock                  = this->tailBlock;
+        auto originalBlockIndexSlotsUsed = pr_blockIndexSlotsUsed;
+        if (this->tailBlock != nullptr && this->tailBlock->next->ConcurrentQueue::Block::template is_empty<explicit_context>()) {
+          this->tailBlock = this->tailBlock->next;
+          this->tailBlock->ConcurrentQueue::Block::template reset_empty<explicit_context>();
+        } else {
+          auto head = this->headIndex.load(std::memory_order_relaxed);
+          assert(!details::circular_less_than<index_t>(currentTailIndex, head));
+          if (!details::circular_less_than<index_t>(head, currentTailIndex + BLOCK_SIZE) ||
+              (MAX_SUBQUEUE_SIZE != details::const_numeric_max<size_t>::value && (MAX_SUBQUEUE_SIZE == 0 || MAX_SUBQUEUE_SIZE - BLOCK_SIZE < currentTailIndex - head)))
+            return false;
+          if (pr_blockIndexRaw == nullptr || pr_blockIndexSlotsUsed == pr_blockIndexSize)
+            if (allocMode == CannotAlloc || !new_block_index(pr_blockIndexSlotsUsed)) return false;
+
+          auto newBlock = this->parent->ConcurrentQueue::template requisition_block<allocMode>();
+          if (newBlock == nullptr) return false;
+          newBlock->ConcurrentQueue::Block::template reset_empty<explicit_context>();
+          if (this->tailBlock == nullptr)
+            newBlock->next = newBlock;
+          else {
+            newBlock->next        = this->tailBlock->next;
+            this->tailBlock->next = newBlock;
+          }
+          this->tailBlock = newBlock;
+          ++pr_blockIndexSlotsUsed;
+        }
+
+        if constexpr (!nothrow) {
+          // Construct before publishing the block so a throwing constructor leaves the queue untouched.
+          try {
+            new ((*this->tailBlock)[currentTailIndex]) T(std::forward<U>(element));
+          } catch (...) {
+            pr_blockIndexSlotsUsed = originalBlockIndexSlotsUsed;
+            this->tailBlock        = startBlock == nullptr ? this->tailBlock : startBlock;
+            throw;
+          }
+        } else {
+          (void)startBlock;
+          (void)originalBlockIndexSlotsUsed;
+        }
+
+        auto &entry = blockIndex.load(std::memory_order_relaxed)->entries[pr_blockIndexFront];
+        entry.base  = currentTailIndex;
+        entry.block = this->tailBlock;
+        blockIndex.load(std::memory_order_relaxed)->front.store(pr_blockIndexFront, std::memory_order_release);
+        pr_blockIndexFront = (pr_blockIndexFront + 1) & (pr_blockIndexSize - 1);
+
+        if constexpr (!nothrow) {
+          this->tailIndex.store(newTailIndex, std::memory_order_release);
+          return true;
+        }
+      }
+
+      new ((*this->tailBlock)[currentTailIndex]) T(std::forward<U>(element));
+      this->tailIndex.store(newTailIndex, std::memory_order_release);
+      return true;
+    }
+
+    template <typename U> bool dequeue(U &element) {
+      auto tail       = this->tailIndex.load(std::memory_order_relaxed);
+      auto overcommit = this->dequeueOvercommit.load(std::memory_order_relaxed);
+      if (details::circular_less_than<index_t>(this->dequeueOptimisticCount.load(std::memory_order_relaxed) - overcommit, tail)) {
+        // Synchronizes with the release on dequeueOvercommit below, so the fetch_add sees a count at least as recent
+        // as the overcommit we loaded.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto myDequeueCount = this->dequeueOptimisticCount.fetch_add(1, std::memory_order_relaxed);
+        tail                = this->tailIndex.load(std::memory_order_acquire);
+        if (__builtin_expect(details::circular_less_than<index_t>(myDequeueCount - overcommit, tail), 1)) {
+          // An element is guaranteed; acq_rel so we also see the element claimed by whoever raced us here.
+          auto index = this->headIndex.fetch_add(1, std::memory_order_acq_rel);
+
+          // Index arithmetic may wrap, so the block offset is divided as a signed value.
+          auto localBlockIndex     = blockIndex.load(std::memory_order_acquire);
+          auto localBlockIndexHead = localBlockIndex->front.load(std::memory_order_acquire);
+          auto headBase            = localBlockIndex->entries[localBlockIndexHead].base;
+          auto blockBaseIndex      = index & ~static_cast<index_t>(BLOCK_SIZE - 1);
+          auto offset              = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(blockBaseIndex - headBase) /
+                                            static_cast<typename std::make_signed<index_t>::type>(BLOCK_SIZE));
+          auto block               = localBlockIndex->entries[(localBlockIndexHead + offset) & (localBlockIndex->size - 1)].block;
+
+          auto &el = *((*block)[index]);
+          if constexpr (!std::is_nothrow_assignable<U &, T &&>::value) {
+            struct Guard {
+              Block *block;
+              index_t index;
+              ~Guard() {
+                (*block)[index]->~T();
+                block->ConcurrentQueue::Block::template set_empty<explicit_context>(index);
+              }
+            } guard = { block, index };
+            element = std::move(el);
+          } else {
+            element = std::move(el);
+            el.~T();
+            block->ConcurrentQueue::Block::template set_empty<explicit_context>(index);
+          }
+          return true;
+        }
+        // Nothing there after all; release so this happens after the fetch_add above.
+        this->dequeueOvercommit.fetch_add(1, std::memory_order_release);
+      }
+      return false;
+    }
+
+    template <AllocationMode allocMode, typename It> bool enqueue_bulk(It itemFirst, size_t count) {
+      constexpr bool nothrow = std::is_nothrow_constructible<T, decltype(*itemFirst)>::value;
+      // Reserve every block first and only publish them once all allocations have succeeded.
+      index_t startTailIndex           = this->tailIndex.load(std::memory_order_relaxed);
+      auto startBlock                  = this->tailBlock;
+      auto originalBlockIndexFront     = pr_blockIndexFront;
+      auto originalBlockIndexSlotsUsed = pr_blockIndexSlotsUsed;
+      Block *firstAllocatedBlock       = nullptr;
+
+      size_t blockBaseDiff =
+          ((startTailIndex + count - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1)) - ((startTailIndex - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1));
+      index_t currentTailIndex = (startTailIndex - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1);
+      if (blockBaseDiff > 0) {
+        // Reuse empty blocks ahead of us first.
+        while (blockBaseDiff > 0 && this->tailBlock != nullptr && this->tailBlock->next != firstAllocatedBlock &&
+               this->tailBlock->next->ConcurrentQueue::Block::template is_empty<explicit_context>()) {
+          blockBaseDiff -= static_cast<index_t>(BLOCK_SIZE);
+          currentTailIndex += static_cast<index_t>(BLOCK_SIZE);
+          this->tailBlock     = this->tailBlock->next;
+          firstAllocatedBlock = firstAllocatedBlock == nullptr ? this->tailBlock : firstAllocatedBlock;
+
+          auto &entry        = blockIndex.load(std::memory_order_relaxed)->entries[pr_blockIndexFront];
+          entry.base         = currentTailIndex;
+          entry.block        = this->tailBlock;
+          pr_blockIndexFront = (pr_blockIndexFront + 1) & (pr_blockIndexSize - 1);
+        }
+
+        while (blockBaseDiff > 0) {
+          blockBaseDiff -= static_cast<index_t>(BLOCK_SIZE);
+          currentTailIndex += static_cast<index_t>(BLOCK_SIZE);
+
+          auto head = this->headIndex.load(std::memory_order_relaxed);
+          assert(!details::circular_less_than<index_t>(currentTailIndex, head));
+          bool full = !details::circular_less_than<index_t>(head, currentTailIndex + BLOCK_SIZE) ||
+                      (MAX_SUBQUEUE_SIZE != details::const_numeric_max<size_t>::value && (MAX_SUBQUEUE_SIZE == 0 || MAX_SUBQUEUE_SIZE - BLOCK_SIZE < currentTailIndex - head));
+          if (pr_blockIndexRaw == nullptr || pr_blockIndexSlotsUsed == pr_blockIndexSize || full) {
+            if (allocMode == CannotAlloc || full || !new_block_index(originalBlockIndexSlotsUsed)) {
+              // Undo, but keep the blocks we linked in for next time.
+              pr_blockIndexFront     = originalBlockIndexFront;
+              pr_blockIndexSlotsUsed = originalBlockIndexSlotsUsed;
+              this->tailBlock        = startBlock == nullptr ? firstAllocatedBlock : startBlock;
+              return false;
+            }
+            // new_block_index moved the front; the new index is kept even if we fail later.
+            originalBlockIndexFront = originalBlockIndexSlotsUsed;
+          }
+
+          auto newBlock = this->parent->ConcurrentQueue::template requisition_block<allocMode>();
+          if (newBlock == nullptr) {
+            pr_blockIndexFront     = originalBlockIndexFront;
+            pr_blockIndexSlotsUsed = originalBlockIndexSlotsUsed;
+            this->tailBlock        = startBlock == nullptr ? firstAllocatedBlock : startBlock;
+            return false;
+          }
+
+          newBlock->ConcurrentQueue::Block::template set_all_empty<explicit_context>();
+          if (this->tailBlock == nullptr)
+            newBlock->next = newBlock;
+          else {
+            newBlock->next        = this->tailBlock->next;
+            this->tailBlock->next = newBlock;
+          }
+          this->tailBlock     = newBlock;
+          firstAllocatedBlock = firstAllocatedBlock == nullptr ? this->tailBlock : firstAllocatedBlock;
+          ++pr_blockIndexSlotsUsed;
+
+          auto &entry        = blockIndex.load(std::memory_order_relaxed)->entries[pr_blockIndexFront];
+          entry.base         = currentTailIndex;
+          entry.block        = this->tailBlock;
+          pr_blockIndexFront = (pr_blockIndexFront + 1) & (pr_blockIndexSize - 1);
+        }
+
+        for (auto block = firstAllocatedBlock;; block = block->next) {
+          block->ConcurrentQueue::Block::template reset_empty<explicit_context>();
+          if (block == this->tailBlock) break;
+        }
+
+        if constexpr (nothrow) blockIndex.load(std::memory_order_relaxed)->front.store((pr_blockIndexFront - 1) & (pr_blockIndexSize - 1), std::memory_order_release);
+      }
+
+      // Fill one block at a time.
+      index_t newTailIndex = startTailIndex + static_cast<index_t>(count);
+      currentTailIndex     = startTailIndex;
+      auto endBlock        = this->tailBlock;
+      this->tailBlock      = startBlock;
+      assert((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) != 0 || firstAllocatedBlock != nullptr || count == 0);
+      if ((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) == 0 && firstAllocatedBlock != nullptr) this->tailBlock = firstAllocatedBlock;
+      while (true) {
+        index_t stopIndex = (currentTailIndex & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+        if (details::circular_less_than<index_t>(newTailIndex, stopIndex)) stopIndex = newTailIndex;
+        if constexpr (nothrow) {
+          while (currentTailIndex != stopIndex) new ((*this->tailBlock)[currentTailIndex++]) T(*itemFirst++);
+        } else {
+          try {
+            // Copy rather than move, so the source is intact if we have to roll back.
+            while (currentTailIndex != stopIndex) {
+              new ((*this->tailBlock)[currentTailIndex]) T(details::nomove(*itemFirst));
+              ++currentTailIndex;
+              ++itemFirst;
+            }
+          } catch (...) {
+            // Destroy what was constructed and revert the whole operation, keeping the allocated blocks.
+            auto constructedStopIndex = currentTailIndex;
+            auto lastBlockEnqueued    = this->tailBlock;
+
+            pr_blockIndexFront     = originalBlockIndexFront;
+            pr_blockIndexSlotsUsed = originalBlockIndexSlotsUsed;
+            this->tailBlock        = startBlock == nullptr ? firstAllocatedBlock : startBlock;
+
+            if (!std::is_trivially_destructible<T>::value) {
+              auto block = startBlock;
+              if ((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) == 0) block = firstAllocatedBlock;
+              currentTailIndex = startTailIndex;
+              while (true) {
+                stopIndex = (currentTailIndex & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+                if (details::circular_less_than<index_t>(constructedStopIndex, stopIndex)) stopIndex = constructedStopIndex;
+                while (currentTailIndex != stopIndex) (*block)[currentTailIndex++]->~T();
+                if (block == lastBlockEnqueued) break;
+                block = block->next;
+              }
+            }
+            throw;
+          }
+        }
+
+        if (this->tailBlock == endBlock) {
+          assert(currentTailIndex == newTailIndex);
+          break;
+        }
+        this->tailBlock = this->tailBlock->next;
+      }
+
+      if constexpr (!nothrow)
+        if (firstAllocatedBlock != nullptr)
+          blockIndex.load(std::memory_order_relaxed)->front.store((pr_blockIndexFront - 1) & (pr_blockIndexSize - 1), std::memory_order_release);
+
+      this->tailIndex.store(newTailIndex, std::memory_order_release);
+      return true;
+    }
+
+    template <typename It> size_t dequeue_bulk(It &itemFirst, size_t max) {
+      auto tail         = this->tailIndex.load(std::memory_order_relaxed);
+      auto overcommit   = this->dequeueOvercommit.load(std::memory_order_relaxed);
+      auto desiredCount = static_cast<size_t>(tail - (this->dequeueOptimisticCount.load(std::memory_order_relaxed) - overcommit));
+      if (details::circular_less_than<size_t>(0, desiredCount)) {
+        desiredCount = desiredCount < max ? desiredCount : max;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        auto myDequeueCount = this->dequeueOptimisticCount.fetch_add(desiredCount, std::memory_order_relaxed);
+
+        tail             = this->tailIndex.load(std::memory_order_acquire);
+        auto actualCount = static_cast<size_t>(tail - (myDequeueCount - overcommit));
+        if (details::circular_less_than<size_t>(0, actualCount)) {
+          actualCount = desiredCount < actualCount ? desiredCount : actualCount;
+          if (actualCount < desiredCount) this->dequeueOvercommit.fetch_add(desiredCount - actualCount, std::memory_order_release);
+
+          auto firstIndex = this->headIndex.fetch_add(actualCount, std::memory_order_acq_rel);
+
+          auto localBlockIndex     = blockIndex.load(std::memory_order_acquire);
+          auto localBlockIndexHead = localBlockIndex->front.load(std::memory_order_acquire);
+          auto headBase            = localBlockIndex->entries[localBlockIndexHead].base;
+          auto firstBlockBaseIndex = firstIndex & ~static_cast<index_t>(BLOCK_SIZE - 1);
+          auto offset              = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(firstBlockBaseIndex - headBase) /
+                                            static_cast<typename std::make_signed<index_t>::type>(BLOCK_SIZE));
+          auto indexIndex          = (localBlockIndexHead + offset) & (localBlockIndex->size - 1);
+
+          auto index = firstIndex;
+          do {
+            auto firstIndexInBlock = index;
+            index_t endIndex       = (index & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+            endIndex = details::circular_less_than<index_t>(firstIndex + static_cast<index_t>(actualCount), endIndex) ? firstIndex + static_cast<index_t>(actualCount) : endIndex;
+            auto block = localBlockIndex->entries[indexIndex].block;
+            if constexpr (std::is_nothrow_assignable<decltype(*itemFirst), T &&>::value) {
+              while (index != endIndex) {
+                auto &el     = *((*block)[index]);
+                *itemFirst++ = std::move(el);
+                el.~T();
+                ++index;
+              }
+            } else {
+              try {
+                while (index != endIndex) {
+                  auto &el   = *((*block)[index]);
+                  *itemFirst = std::move(el);
+                  ++itemFirst;
+                  el.~T();
+                  ++index;
+                }
+              } catch (...) {
+                // Too late to undo the dequeue; destroy the claimed elements and mark their slots empty.
+                do {
+                  block = localBlockIndex->entries[indexIndex].block;
+                  while (index != endIndex) (*block)[index++]->~T();
+                  block->ConcurrentQueue::Block::template set_many_empty<explicit_context>(firstIndexInBlock, static_cast<size_t>(endIndex - firstIndexInBlock));
+                  indexIndex = (indexIndex + 1) & (localBlockIndex->size - 1);
+
+                  firstIndexInBlock = index;
+                  endIndex          = (index & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+                  endIndex          = details::circular_less_than<index_t>(firstIndex + static_cast<index_t>(actualCount), endIndex) ?
+                                 firstIndex + static_cast<index_t>(actualCount) :
+                                 endIndex;
+                } while (index != firstIndex + actualCount);
+                throw;
+              }
+            }
+            block->ConcurrentQueue::Block::template set_many_empty<explicit_context>(firstIndexInBlock, static_cast<size_t>(endIndex - firstIndexInBlock));
+            indexIndex = (indexIndex + 1) & (localBlockIndex->size - 1);
+          } while (index != firstIndex + actualCount);
+
+          return actualCount;
+        }
+        this->dequeueOvercommit.fetch_add(desiredCount, std::memory_order_release);
+      }
+      return 0;
+    }
+
     struct BlockIndexEntry {
       index_t base;
       Block *block;
@@ -169,22 +1126,384 @@ template <typename T, typename Traits = ConcurrentQueueDefaultTraits> class Conc
       BlockIndexEntry *entries;
       void *prev;
     };
-    bool new_block_index(size_t numberOfFilledSlotsToExpose);
+
+    // Doubles the block index. Old indices stay alive (linked through prev) since consumers may still be reading them.
+    bool new_block_index(size_t numberOfFilledSlotsToExpose) {
+      auto prevBlockSizeMask = pr_blockIndexSize - 1;
+
+      pr_blockIndexSize <<= 1;
+      auto newRawPtr = static_cast<char *>(
+          (Traits::malloc)(sizeof(BlockIndexHeader) + alignof(BlockIndexEntry) - 1 + sizeof(BlockIndexEntry) * pr_blockIndexSize));
+      if (newRawPtr == nullptr) {
+        pr_blockIndexSize >>= 1;
+        return false;
+      }
+
+      auto newBlockIndexEntries = reinterpret_cast<BlockIndexEntry *>(details::align_for<BlockIndexEntry>(newRawPtr + sizeof(BlockIndexHeader)));
+
+      size_t j = 0;
+      if (pr_blockIndexSlotsUsed != 0) {
+        auto i = (pr_blockIndexFront - pr_blockIndexSlotsUsed) & prevBlockSizeMask;
+        do {
+          newBlockIndexEntries[j++] = pr_blockIndexEntries[i];
+          i                         = (i + 1) & prevBlockSizeMask;
+        } while (i != pr_blockIndexFront);
+      }
+
+      auto header  = new (newRawPtr) BlockIndexHeader;
+      header->size = pr_blockIndexSize;
+      header->front.store(numberOfFilledSlotsToExpose - 1, std::memory_order_relaxed);
+      header->entries = newBlockIndexEntries;
+      header->prev    = pr_blockIndexRaw;
+
+      pr_blockIndexFront   = j;
+      pr_blockIndexEntries = newBlockIndexEntries;
+      pr_blockIndexRaw     = newRawPtr;
+      blockIndex.store(header, std::memory_order_release);
+      return true;
+    }
+
     std::atomic<BlockIndexHeader *> blockIndex;
+    // Producer-side copies; consumers only read the header published in blockIndex.
     size_t pr_blockIndexSlotsUsed;
     size_t pr_blockIndexSize;
     size_t pr_blockIndexFront;
     BlockIndexEntry *pr_blockIndexEntries;
     void *pr_blockIndexRaw;
   };
+
+  // Sub-queue of a thread enqueuing without a token. Blocks go back to the queue's free list as soon as they are
+  // drained, and a hashed index maps block base positions to blocks.
   struct ImplicitProducer : public ProducerBase {
-    ImplicitProducer(ConcurrentQueue *parent);
-    ~ImplicitProducer();
-    template <AllocationMode allocMode, typename U> inline bool enqueue(U &&element);
-    template <typename U> bool dequeue(U &element);
-    template <AllocationMode allocMode, typename It> bool enqueue_bulk(It itemFirst, size_t count);
-    template <typename It> size_t dequeue_bulk(It &itemFirst, size_t max);
-    static const index_t INVALID_BLOCK_BASE = 1;
+    ImplicitProducer(ConcurrentQueue *parent) : ProducerBase(parent, false), nextBlockIndexCapacity(IMPLICIT_INITIAL_INDEX_SIZE), blockIndex(nullptr) {
+      new_block_index();
+    }
+
+    ~ImplicitProducer() {
+      // All operations have finished, so the remaining elements are contiguous and only the first and last blocks
+      // can be partially empty.
+      if (!this->inactive.load(std::memory_order_relaxed)) details::ThreadExitNotifier::unsubscribe(&threadExitListener);
+
+      auto tail    = this->tailIndex.load(std::memory_order_relaxed);
+      auto index   = this->headIndex.load(std::memory_order_relaxed);
+      Block *block = nullptr;
+      assert(index == tail || details::circular_less_than(index, tail));
+      bool forceFreeLastBlock = index != tail;
+      while (index != tail) {
+        if ((index & static_cast<index_t>(BLOCK_SIZE - 1)) == 0 || block == nullptr) {
+          if (block != nullptr) this->parent->add_block_to_free_list(block);
+          block = get_block_index_entry_for_index(index)->value.load(std::memory_order_relaxed);
+        }
+        ((*block)[index])->~T();
+        ++index;
+      }
+      // The tail block is still ours unless the head reached its end, in which case the next enqueue would have
+      // fetched a new one.
+      if (this->tailBlock != nullptr && (forceFreeLastBlock || (tail & static_cast<index_t>(BLOCK_SIZE - 1)) != 0))
+        this->parent->add_block_to_free_list(this->tailBlock);
+
+      auto localBlockIndex = blockIndex.load(std::memory_order_relaxed);
+      if (localBlockIndex != nullptr) {
+        for (size_t i = 0; i != localBlockIndex->capacity; ++i) localBlockIndex->index[i]->~BlockIndexEntry();
+        do {
+          auto prev = localBlockIndex->prev;
+          localBlockIndex->~BlockIndexHeader();
+          (Traits::free)(localBlockIndex);
+          localBlockIndex = prev;
+        } while (localBlockIndex != nullptr);
+      }
+    }
+
+    template <AllocationMode allocMode, typename U> inline bool enqueue(U &&element) {
+      constexpr bool nothrow   = std::is_nothrow_constructible<T, U &&>::value;
+      index_t currentTailIndex = this->tailIndex.load(std::memory_order_relaxed);
+      index_t newTailIndex     = 1 + currentTailIndex;
+      if ((currentTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) == 0) {
+        auto head = this->headIndex.load(std::memory_order_relaxed);
+        assert(!details::circular_less_than<index_t>(currentTailIndex, head));
+        if (!details::circular_less_than<index_t>(head, currentTailIndex + BLOCK_SIZE) ||
+            (MAX_SUBQUEUE_SIZE != details::const_numeric_max<size_t>::value && (MAX_SUBQUEUE_SIZE == 0 || MAX_SUBQUEUE_SIZE - BLOCK_SIZE < currentTailIndex - head)))
+          return false;
+
+        BlockIndexEntry *idxEntry;
+        if (!insert_block_index_entry<allocMode>(idxEntry, currentTailIndex)) return false;
+
+        auto newBlock = this->parent->ConcurrentQueue::template requisition_block<allocMode>();
+        if (newBlock == nullptr) {
+          rewind_block_index_tail();
+          idxEntry->value.store(nullptr, std::memory_order_relaxed);
+          return false;
+        }
+        newBlock->ConcurrentQueue::Block::template reset_empty<implicit_context>();
+
+        if constexpr (!nothrow) {
+          // Construct before publishing the block so a throwing constructor leaves the queue untouched.
+          try {
+            new ((*newBlock)[currentTailIndex]) T(std::forward<U>(element));
+          } catch (...) {
+            rewind_block_index_tail();
+            idxEntry->value.store(nullptr, std::memory_order_relaxed);
+            this->parent->add_block_to_free_list(newBlock);
+            throw;
+          }
+        }
+
+        idxEntry->value.store(newBlock, std::memory_order_relaxed);
+        this->tailBlock = newBlock;
+
+        if constexpr (!nothrow) {
+          this->tailIndex.store(newTailIndex, std::memory_order_release);
+          return true;
+        }
+      }
+
+      new ((*this->tailBlock)[currentTailIndex]) T(std::forward<U>(element));
+      this->tailIndex.store(newTailIndex, std::memory_order_release);
+      return true;
+    }
+
+    // See ExplicitProducer::dequeue for the counting scheme.
+    template <typename U> bool dequeue(U &element) {
+      index_t tail       = this->tailIndex.load(std::memory_order_relaxed);
+      index_t overcommit = this->dequeueOvercommit.load(std::memory_order_relaxed);
+      if (details::circular_less_than<index_t>(this->dequeueOptimisticCount.load(std::memory_order_relaxed) - overcommit, tail)) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        index_t myDequeueCount = this->dequeueOptimisticCount.fetch_add(1, std::memory_order_relaxed);
+        tail                   = this->tailIndex.load(std::memory_order_acquire);
+        if (__builtin_expect(details::circular_less_than<index_t>(myDequeueCount - overcommit, tail), 1)) {
+          index_t index = this->headIndex.fetch_add(1, std::memory_order_acq_rel);
+          auto entry    = get_block_index_entry_for_index(index);
+          auto block    = entry->value.load(std::memory_order_relaxed);
+          auto &el      = *((*block)[index]);
+
+          if constexpr (!std::is_nothrow_assignable<U &, T &&>::value) {
+            struct Guard {
+              Block *block;
+              index_t index;
+              BlockIndexEntry *entry;
+              ConcurrentQueue *parent;
+              ~Guard() {
+                (*block)[index]->~T();
+                if (block->ConcurrentQueue::Block::template set_empty<implicit_context>(index)) {
+                  entry->value.store(nullptr, std::memory_order_relaxed);
+                  parent->add_block_to_free_list(block);
+                }
+              }
+            } guard = { block, index, entry, this->parent };
+            element = std::move(el);
+          } else {
+            element = std::move(el);
+            el.~T();
+            if (block->ConcurrentQueue::Block::template set_empty<implicit_context>(index)) {
+              // Return the block to the pool; adding it to the free list releases the store above.
+              entry->value.store(nullptr, std::memory_order_relaxed);
+              this->parent->add_block_to_free_list(block);
+            }
+          }
+          return true;
+        }
+        this->dequeueOvercommit.fetch_add(1, std::memory_order_release);
+      }
+      return false;
+    }
+
+    template <AllocationMode allocMode, typename It> bool enqueue_bulk(It itemFirst, size_t count) {
+      constexpr bool nothrow = std::is_nothrow_constructible<T, decltype(*itemFirst)>::value;
+      // Reserve every block first. The starting tailBlock may no longer be ours if it was filled exactly and then
+      // drained, so new blocks are chained through next only for this operation.
+      index_t startTailIndex     = this->tailIndex.load(std::memory_order_relaxed);
+      auto startBlock            = this->tailBlock;
+      Block *firstAllocatedBlock = nullptr;
+      auto endBlock              = this->tailBlock;
+
+      size_t blockBaseDiff =
+          ((startTailIndex + count - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1)) - ((startTailIndex - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1));
+      index_t currentTailIndex = (startTailIndex - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1);
+      if (blockBaseDiff > 0) {
+        do {
+          blockBaseDiff -= static_cast<index_t>(BLOCK_SIZE);
+          currentTailIndex += static_cast<index_t>(BLOCK_SIZE);
+
+          BlockIndexEntry *idxEntry = nullptr;
+          Block *newBlock           = nullptr;
+          bool indexInserted        = false;
+          auto head                 = this->headIndex.load(std::memory_order_relaxed);
+          assert(!details::circular_less_than<index_t>(currentTailIndex, head));
+          bool full = !details::circular_less_than<index_t>(head, currentTailIndex + BLOCK_SIZE) ||
+                      (MAX_SUBQUEUE_SIZE != details::const_numeric_max<size_t>::value && (MAX_SUBQUEUE_SIZE == 0 || MAX_SUBQUEUE_SIZE - BLOCK_SIZE < currentTailIndex - head));
+
+          if (full || !(indexInserted = insert_block_index_entry<allocMode>(idxEntry, currentTailIndex)) ||
+              (newBlock = this->parent->ConcurrentQueue::template requisition_block<allocMode>()) == nullptr) {
+            // Revert the index insertions and allocations done so far.
+            if (indexInserted) {
+              rewind_block_index_tail();
+              idxEntry->value.store(nullptr, std::memory_order_relaxed);
+            }
+            currentTailIndex = (startTailIndex - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1);
+            for (auto block = firstAllocatedBlock; block != nullptr; block = block->next) {
+              currentTailIndex += static_cast<index_t>(BLOCK_SIZE);
+              idxEntry = get_block_index_entry_for_index(currentTailIndex);
+              idxEntry->value.store(nullptr, std::memory_order_relaxed);
+              rewind_block_index_tail();
+            }
+            this->parent->add_blocks_to_free_list(firstAllocatedBlock);
+            this->tailBlock = startBlock;
+            return false;
+          }
+
+          newBlock->ConcurrentQueue::Block::template reset_empty<implicit_context>();
+          newBlock->next = nullptr;
+          idxEntry->value.store(newBlock, std::memory_order_relaxed);
+
+          if ((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) != 0 || firstAllocatedBlock != nullptr) {
+            assert(this->tailBlock != nullptr);
+            this->tailBlock->next = newBlock;
+          }
+          this->tailBlock     = newBlock;
+          endBlock            = newBlock;
+          firstAllocatedBlock = firstAllocatedBlock == nullptr ? newBlock : firstAllocatedBlock;
+        } while (blockBaseDiff > 0);
+      }
+
+      index_t newTailIndex = startTailIndex + static_cast<index_t>(count);
+      currentTailIndex     = startTailIndex;
+      this->tailBlock      = startBlock;
+      assert((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) != 0 || firstAllocatedBlock != nullptr || count == 0);
+      if ((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) == 0 && firstAllocatedBlock != nullptr) this->tailBlock = firstAllocatedBlock;
+      while (true) {
+        index_t stopIndex = (currentTailIndex & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+        if (details::circular_less_than<index_t>(newTailIndex, stopIndex)) stopIndex = newTailIndex;
+        if constexpr (nothrow) {
+          while (currentTailIndex != stopIndex) new ((*this->tailBlock)[currentTailIndex++]) T(*itemFirst++);
+        } else {
+          try {
+            while (currentTailIndex != stopIndex) {
+              new ((*this->tailBlock)[currentTailIndex]) T(details::nomove(*itemFirst));
+              ++currentTailIndex;
+              ++itemFirst;
+            }
+          } catch (...) {
+            auto constructedStopIndex = currentTailIndex;
+            auto lastBlockEnqueued    = this->tailBlock;
+
+            if (!std::is_trivially_destructible<T>::value) {
+              auto block = startBlock;
+              if ((startTailIndex & static_cast<index_t>(BLOCK_SIZE - 1)) == 0) block = firstAllocatedBlock;
+              currentTailIndex = startTailIndex;
+              while (true) {
+                stopIndex = (currentTailIndex & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+                if (details::circular_less_than<index_t>(constructedStopIndex, stopIndex)) stopIndex = constructedStopIndex;
+                while (currentTailIndex != stopIndex) (*block)[currentTailIndex++]->~T();
+                if (block == lastBlockEnqueued) break;
+                block = block->next;
+              }
+            }
+
+            currentTailIndex = (startTailIndex - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1);
+            for (auto block = firstAllocatedBlock; block != nullptr; block = block->next) {
+              currentTailIndex += static_cast<index_t>(BLOCK_SIZE);
+              auto idxEntry = get_block_index_entry_for_index(currentTailIndex);
+              idxEntry->value.store(nullptr, std::memory_order_relaxed);
+              rewind_block_index_tail();
+            }
+            this->parent->add_blocks_to_free_list(firstAllocatedBlock);
+            this->tailBlock = startBlock;
+            throw;
+          }
+        }
+
+        if (this->tailBlock == endBlock) {
+          assert(currentTailIndex == newTailIndex);
+          break;
+        }
+        this->tailBlock = this->tailBlock->next;
+      }
+      this->tailIndex.store(newTailIndex, std::memory_order_release);
+      return true;
+    }
+
+    template <typename It> size_t dequeue_bulk(It &itemFirst, size_t max) {
+      auto tail         = this->tailIndex.load(std::memory_order_relaxed);
+      auto overcommit   = this->dequeueOvercommit.load(std::memory_order_relaxed);
+      auto desiredCount = static_cast<size_t>(tail - (this->dequeueOptimisticCount.load(std::memory_order_relaxed) - overcommit));
+      if (details::circular_less_than<size_t>(0, desiredCount)) {
+        desiredCount = desiredCount < max ? desiredCount : max;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        auto myDequeueCount = this->dequeueOptimisticCount.fetch_add(desiredCount, std::memory_order_relaxed);
+
+        tail             = this->tailIndex.load(std::memory_order_acquire);
+        auto actualCount = static_cast<size_t>(tail - (myDequeueCount - overcommit));
+        if (details::circular_less_than<size_t>(0, actualCount)) {
+          actualCount = desiredCount < actualCount ? desiredCount : actualCount;
+          if (actualCount < desiredCount) this->dequeueOvercommit.fetch_add(desiredCount - actualCount, std::memory_order_release);
+
+          auto firstIndex = this->headIndex.fetch_add(actualCount, std::memory_order_acq_rel);
+
+          auto index = firstIndex;
+          BlockIndexHeader *localBlockIndex;
+          auto indexIndex = get_block_index_index_for_index(index, localBlockIndex);
+          do {
+            auto blockStartIndex = index;
+            index_t endIndex     = (index & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+            endIndex = details::circular_less_than<index_t>(firstIndex + static_cast<index_t>(actualCount), endIndex) ? firstIndex + static_cast<index_t>(actualCount) : endIndex;
+
+            auto entry = localBlockIndex->index[indexIndex];
+            auto block = entry->value.load(std::memory_order_relaxed);
+            if constexpr (std::is_nothrow_assignable<decltype(*itemFirst), T &&>::value) {
+              while (index != endIndex) {
+                auto &el     = *((*block)[index]);
+                *itemFirst++ = std::move(el);
+                el.~T();
+                ++index;
+              }
+            } else {
+              try {
+                while (index != endIndex) {
+                  auto &el   = *((*block)[index]);
+                  *itemFirst = std::move(el);
+                  ++itemFirst;
+                  el.~T();
+                  ++index;
+                }
+              } catch (...) {
+                do {
+                  entry = localBlockIndex->index[indexIndex];
+                  block = entry->value.load(std::memory_order_relaxed);
+                  while (index != endIndex) (*block)[index++]->~T();
+
+                  if (block->ConcurrentQueue::Block::template set_many_empty<implicit_context>(blockStartIndex, static_cast<size_t>(endIndex - blockStartIndex))) {
+                    entry->value.store(nullptr, std::memory_order_relaxed);
+                    this->parent->add_block_to_free_list(block);
+                  }
+                  indexIndex = (indexIndex + 1) & (localBlockIndex->capacity - 1);
+
+                  blockStartIndex = index;
+                  endIndex        = (index & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
+                  endIndex        = details::circular_less_than<index_t>(firstIndex + static_cast<index_t>(actualCount), endIndex) ?
+                                 firstIndex + static_cast<index_t>(actualCount) :
+                                 endIndex;
+                } while (index != firstIndex + actualCount);
+                throw;
+              }
+            }
+            if (block->ConcurrentQueue::Block::template set_many_empty<implicit_context>(blockStartIndex, static_cast<size_t>(endIndex - blockStartIndex))) {
+              // set_many_empty released our reads and writes, so whoever takes the block next may use it.
+              entry->value.store(nullptr, std::memory_order_relaxed);
+              this->parent->add_block_to_free_list(block);
+            }
+            indexIndex = (indexIndex + 1) & (localBlockIndex->capacity - 1);
+          } while (index != firstIndex + actualCount);
+
+          return actualCount;
+        }
+        this->dequeueOvercommit.fetch_add(desiredCount, std::memory_order_release);
+      }
+      return 0;
+    }
+
+    // Block sizes are > 1, so a base index with the low bit set is never valid.
+    static constexpr index_t INVALID_BLOCK_BASE = 1;
     struct BlockIndexEntry {
       std::atomic<index_t> key;
       std::atomic<Block *> value;
@@ -197,48 +1516,404 @@ template <typename T, typename Traits = ConcurrentQueueDefaultTraits> class Conc
       BlockIndexEntry **index;
       BlockIndexHeader *prev;
     };
-    template <AllocationMode allocMode> inline bool insert_block_index_entry(BlockIndexEntry *&idxEntry, index_t blockStartIndex);
-    inline void rewind_block_index_tail();
-    inline BlockIndexEntry *get_block_index_entry_for_index(index_t index) const;
-    inline size_t get_block_index_index_for_index(index_t index, BlockIndexHeader *&localBlockIndex) const;
-    bool new_block_index();
+
+    template <AllocationMode allocMode> inline bool insert_block_index_entry(BlockIndexEntry *&idxEntry, index_t blockStartIndex) {
+      // Only this producer's thread writes the index, so relaxed loads are enough.
+      auto localBlockIndex = blockIndex.load(std::memory_order_relaxed);
+      if (localBlockIndex == nullptr) return false;
+      size_t newTail = (localBlockIndex->tail.load(std::memory_order_relaxed) + 1) & (localBlockIndex->capacity - 1);
+      idxEntry       = localBlockIndex->index[newTail];
+      if (idxEntry->key.load(std::memory_order_relaxed) == INVALID_BLOCK_BASE || idxEntry->value.load(std::memory_order_relaxed) == nullptr) {
+        idxEntry->key.store(blockStartIndex, std::memory_order_relaxed);
+        localBlockIndex->tail.store(newTail, std::memory_order_release);
+        return true;
+      }
+
+      if (allocMode == CannotAlloc || !new_block_index()) return false;
+      localBlockIndex = blockIndex.load(std::memory_order_relaxed);
+      newTail         = (localBlockIndex->tail.load(std::memory_order_relaxed) + 1) & (localBlockIndex->capacity - 1);
+      idxEntry        = localBlockIndex->index[newTail];
+      assert(idxEntry->key.load(std::memory_order_relaxed) == INVALID_BLOCK_BASE);
+      idxEntry->key.store(blockStartIndex, std::memory_order_relaxed);
+      localBlockIndex->tail.store(newTail, std::memory_order_release);
+      return true;
+    }
+
+    inline void rewind_block_index_tail() {
+      auto localBlockIndex = blockIndex.load(std::memory_order_relaxed);
+      localBlockIndex->tail.store((localBlockIndex->tail.load(std::memory_order_relaxed) - 1) & (localBlockIndex->capacity - 1), std::memory_order_relaxed);
+    }
+
+    inline BlockIndexEntry *get_block_index_entry_for_index(index_t index) const {
+      BlockIndexHeader *localBlockIndex;
+      auto idx = get_block_index_index_for_index(index, localBlockIndex);
+      return localBlockIndex->index[idx];
+    }
+
+    inline size_t get_block_index_index_for_index(index_t index, BlockIndexHeader *&localBlockIndex) const {
+      index &= ~static_cast<index_t>(BLOCK_SIZE - 1);
+      localBlockIndex = blockIndex.load(std::memory_order_acquire);
+      auto tail       = localBlockIndex->tail.load(std::memory_order_acquire);
+      auto tailBase   = localBlockIndex->index[tail]->key.load(std::memory_order_relaxed);
+      assert(tailBase != INVALID_BLOCK_BASE);
+      // Divide rather than shift: the offset may be negative after index wrap-around.
+      auto offset = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(index - tailBase) /
+                                        static_cast<typename std::make_signed<index_t>::type>(BLOCK_SIZE));
+      size_t idx  = (tail + offset) & (localBlockIndex->capacity - 1);
+      assert(localBlockIndex->index[idx]->key.load(std::memory_order_relaxed) == index && localBlockIndex->index[idx]->value.load(std::memory_order_relaxed) != nullptr);
+      return idx;
+    }
+
+    // Grows the index; entries of previous indices are reused in place, so lookups through an old header stay valid.
+    bool new_block_index() {
+      auto prev           = blockIndex.load(std::memory_order_relaxed);
+      size_t prevCapacity = prev == nullptr ? 0 : prev->capacity;
+      auto entryCount     = prev == nullptr ? nextBlockIndexCapacity : prevCapacity;
+      auto raw            = static_cast<char *>((Traits::malloc)(sizeof(BlockIndexHeader) + alignof(BlockIndexEntry) - 1 + sizeof(BlockIndexEntry) * entryCount +
+                                                      alignof(BlockIndexEntry *) - 1 + sizeof(BlockIndexEntry *) * nextBlockIndexCapacity));
+      if (raw == nullptr) return false;
+
+      auto header  = new (raw) BlockIndexHeader;
+      auto entries = reinterpret_cast<BlockIndexEntry *>(details::align_for<BlockIndexEntry>(raw + sizeof(BlockIndexHeader)));
+      auto index   = reinterpret_cast<BlockIndexEntry **>(details::align_for<BlockIndexEntry *>(reinterpret_cast<char *>(entries) + sizeof(BlockIndexEntry) * entryCount));
+      if (prev != nullptr) {
+        auto prevTail = prev->tail.load(std::memory_order_relaxed);
+        auto prevPos  = prevTail;
+        size_t i      = 0;
+        do {
+          prevPos    = (prevPos + 1) & (prev->capacity - 1);
+          index[i++] = prev->index[prevPos];
+        } while (prevPos != prevTail);
+        assert(i == prevCapacity);
+      }
+      for (size_t i = 0; i != entryCount; ++i) {
+        new (entries + i) BlockIndexEntry;
+        entries[i].key.store(INVALID_BLOCK_BASE, std::memory_order_relaxed);
+        index[prevCapacity + i] = entries + i;
+      }
+      header->prev     = prev;
+      header->entries  = entries;
+      header->index    = index;
+      header->capacity = nextBlockIndexCapacity;
+      header->tail.store((prevCapacity - 1) & (nextBlockIndexCapacity - 1), std::memory_order_relaxed);
+
+      blockIndex.store(header, std::memory_order_release);
+      nextBlockIndexCapacity <<= 1;
+      return true;
+    }
+
     size_t nextBlockIndexCapacity;
     std::atomic<BlockIndexHeader *> blockIndex;
     details::ThreadExitListener threadExitListener;
   };
-  void populate_initial_block_list(size_t blockCount);
-  inline Block *try_get_block_from_initial_pool();
-  inline void add_block_to_free_list(Block *block);
-  inline void add_blocks_to_free_list(Block *block);
-  inline Block *try_get_block_from_free_list();
-  template <AllocationMode canAlloc> Block *requisition_block();
-  ProducerBase *recycle_or_create_producer(bool isExplicit);
-  ProducerBase *recycle_or_create_producer(bool isExplicit, bool &recycled);
-  ProducerBase *add_producer(ProducerBase *producer);
-  void reown_producers();
+
+  void populate_initial_block_list(size_t blockCount) {
+    initialBlockPoolSize = blockCount;
+    if (initialBlockPoolSize == 0) {
+      initialBlockPool = nullptr;
+      return;
+    }
+    initialBlockPool = create_array<Block>(blockCount);
+    if (initialBlockPool == nullptr) initialBlockPoolSize = 0;
+    for (size_t i = 0; i < initialBlockPoolSize; ++i) initialBlockPool[i].dynamicallyAllocated = false;
+  }
+
+  inline Block *try_get_block_from_initial_pool() {
+    if (initialBlockPoolIndex.load(std::memory_order_relaxed) >= initialBlockPoolSize) return nullptr;
+    auto index = initialBlockPoolIndex.fetch_add(1, std::memory_order_relaxed);
+    return index < initialBlockPoolSize ? (initialBlockPool + index) : nullptr;
+  }
+
+  inline void add_block_to_free_list(Block *block) { freeList.add(block); }
+
+  inline void add_blocks_to_free_list(Block *block) {
+    while (block != nullptr) {
+      auto next = block->next;
+      add_block_to_free_list(block);
+      block = next;
+    }
+  }
+
+  inline Block *try_get_block_from_free_list() { return freeList.try_get(); }
+
+  // Takes a block from the initial pool, then the free list, and allocates only as a last resort.
+  template <AllocationMode canAlloc> Block *requisition_block() {
+    auto block = try_get_block_from_initial_pool();
+    if (block != nullptr) return block;
+    block = try_get_block_from_free_list();
+    if (block != nullptr) return block;
+    if constexpr (canAlloc == CanAlloc) return create<Block>();
+    return nullptr;
+  }
+
+  ProducerBase *recycle_or_create_producer(bool isExplicit) {
+    bool recycled;
+    return recycle_or_create_producer(isExplicit, recycled);
+  }
+
+  // Producers are never freed while the queue lives; an inactive one (token destroyed or thread exited) is reused.
+  ProducerBase *recycle_or_create_producer(bool isExplicit, bool &recycled) {
+    for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod()) {
+      if (ptr->inactive.load(std::memory_order_relaxed) && ptr->isExplicit == isExplicit) {
+        bool expected = true;
+        if (ptr->inactive.compare_exchange_strong(expected, false, std::memory_order_acquire, std::memory_order_relaxed)) {
+          recycled = true;
+          return ptr;
+        }
+      }
+    }
+    recycled = false;
+    return add_producer(isExplicit ? static_cast<ProducerBase *>(create<ExplicitProducer>(this)) : create<ImplicitProducer>(this));
+  }
+
+  ProducerBase *add_producer(ProducerBase *producer) {
+    if (producer == nullptr) return nullptr;
+    producerCount.fetch_add(1, std::memory_order_relaxed);
+    auto prevTail = producerListTail.load(std::memory_order_relaxed);
+    do {
+      producer->next = prevTail;
+    } while (!producerListTail.compare_exchange_weak(prevTail, producer, std::memory_order_release, std::memory_order_relaxed));
+    return producer;
+  }
+
+  // After a move or swap the producers we took over still point at the other queue.
+  void reown_producers() {
+    for (auto ptr = producerListTail.load(std::memory_order_relaxed); ptr != nullptr; ptr = ptr->next_prod()) ptr->parent = this;
+  }
+
   struct ImplicitProducerKVP {
     std::atomic<details::thread_id_t> key;
+    // Only read by the thread that set it, so it needs no atomicity.
     ImplicitProducer *value;
-    ImplicitProducerKVP();
-    ImplicitProducerKVP(ImplicitProducerKVP &&other) noexcept;
-    inline ImplicitProducerKVP &operator=(ImplicitProducerKVP &&other) noexcept;
-    inline void swap(ImplicitProducerKVP &other) noexcept;
+    ImplicitProducerKVP() : value(nullptr) {}
+    ImplicitProducerKVP(ImplicitProducerKVP &&other) noexcept {
+      key.store(other.key.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      value = other.value;
+    }
+    inline ImplicitProducerKVP &operator=(ImplicitProducerKVP &&other) noexcept {
+      swap(other);
+      return *this;
+    }
+    inline void swap(ImplicitProducerKVP &other) noexcept {
+      if (this != &other) {
+        details::swap_relaxed(key, other.key);
+        std::swap(value, other.value);
+      }
+    }
   };
+
   struct ImplicitProducerHash {
     size_t capacity;
     ImplicitProducerKVP *entries;
     ImplicitProducerHash *prev;
   };
-  inline void populate_initial_implicit_producer_hash();
-  void swap_implicit_producer_hashes(ConcurrentQueue &other);
-  ImplicitProducer *get_or_add_implicit_producer();
-  void implicit_producer_thread_exited(ImplicitProducer *producer);
-  static void implicit_producer_thread_exited_callback(void *userData);
-  template <typename U> static inline U *create_array(size_t count);
-  template <typename U> static inline void destroy_array(U *p, size_t count);
-  template <typename U> static inline U *create();
-  template <typename U, typename A1> static inline U *create(A1 &&a1);
-  template <typename U> static inline void destroy(U *p);
+
+  inline void populate_initial_implicit_producer_hash() {
+    implicitProducerHashCount.store(0, std::memory_order_relaxed);
+    auto hash      = &initialImplicitProducerHash;
+    hash->capacity = INITIAL_IMPLICIT_PRODUCER_HASH_SIZE;
+    hash->entries  = &initialImplicitProducerHashEntries[0];
+    for (size_t i = 0; i != INITIAL_IMPLICIT_PRODUCER_HASH_SIZE; ++i) initialImplicitProducerHashEntries[i].key.store(details::invalid_thread_id, std::memory_order_relaxed);
+    hash->prev = nullptr;
+    implicitProducerHash.store(hash, std::memory_order_relaxed);
+  }
+
+  // Swaps the hash chains; each chain ends in its queue's embedded initial hash, which has to stay with its queue.
+  void swap_implicit_producer_hashes(ConcurrentQueue &other) {
+    initialImplicitProducerHashEntries.swap(other.initialImplicitProducerHashEntries);
+    initialImplicitProducerHash.entries       = &initialImplicitProducerHashEntries[0];
+    other.initialImplicitProducerHash.entries = &other.initialImplicitProducerHashEntries[0];
+
+    details::swap_relaxed(implicitProducerHashCount, other.implicitProducerHashCount);
+
+    details::swap_relaxed(implicitProducerHash, other.implicitProducerHash);
+    if (implicitProducerHash.load(std::memory_order_relaxed) == &other.initialImplicitProducerHash)
+      implicitProducerHash.store(&initialImplicitProducerHash, std::memory_order_relaxed);
+    else {
+      ImplicitProducerHash *hash;
+      for (hash = implicitProducerHash.load(std::memory_order_relaxed); hash->prev != &other.initialImplicitProducerHash; hash = hash->prev) continue;
+      hash->prev = &initialImplicitProducerHash;
+    }
+    if (other.implicitProducerHash.load(std::memory_order_relaxed) == &initialImplicitProducerHash)
+      other.implicitProducerHash.store(&other.initialImplicitProducerHash, std::memory_order_relaxed);
+    else {
+      ImplicitProducerHash *hash;
+      for (hash = other.implicitProducerHash.load(std::memory_order_relaxed); hash->prev != &initialImplicitProducerHash; hash = hash->prev) continue;
+      hash->prev = &other.initialImplicitProducerHash;
+    }
+  }
+
+  // Looks the calling thread up in an open-addressing hash keyed by thread id, walking older tables too; a thread
+  // found only in an old table is re-inserted into the current one. Tables only grow, and every table reserves room
+  // for all entries of the previous ones.
+  ImplicitProducer *get_or_add_implicit_producer() {
+    auto id       = details::thread_id();
+    auto hashedId = details::hash_thread_id(id);
+
+    auto mainHash = implicitProducerHash.load(std::memory_order_acquire);
+    assert(mainHash != nullptr);
+    for (auto hash = mainHash; hash != nullptr; hash = hash->prev) {
+      auto index = hashedId;
+      while (true) {
+        index &= hash->capacity - 1u;
+        auto probedKey = hash->entries[index].key.load(std::memory_order_relaxed);
+        if (probedKey == id) {
+          auto value = hash->entries[index].value;
+          if (hash != mainHash) {
+            index = hashedId;
+            while (true) {
+              index &= mainHash->capacity - 1u;
+              auto empty    = details::invalid_thread_id;
+              auto reusable = details::invalid_thread_id2;
+              if (mainHash->entries[index].key.compare_exchange_strong(empty, id, std::memory_order_seq_cst, std::memory_order_relaxed) ||
+                  mainHash->entries[index].key.compare_exchange_strong(reusable, id, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                mainHash->entries[index].value = value;
+                break;
+              }
+              ++index;
+            }
+          }
+          return value;
+        }
+        if (probedKey == details::invalid_thread_id) break;
+        ++index;
+      }
+    }
+
+    auto newCount = 1 + implicitProducerHashCount.fetch_add(1, std::memory_order_relaxed);
+    while (true) {
+      if (newCount >= (mainHash->capacity >> 1) && !implicitProducerHashResizeInProgress.test_and_set(std::memory_order_acquire)) {
+        // We hold the resize lock; the acquire above makes this the latest table.
+        mainHash = implicitProducerHash.load(std::memory_order_acquire);
+        if (newCount >= (mainHash->capacity >> 1)) {
+          size_t newCapacity = mainHash->capacity << 1;
+          while (newCount >= (newCapacity >> 1)) newCapacity <<= 1;
+          auto raw = static_cast<char *>((Traits::malloc)(sizeof(ImplicitProducerHash) + alignof(ImplicitProducerKVP) - 1 + sizeof(ImplicitProducerKVP) * newCapacity));
+          if (raw == nullptr) {
+            implicitProducerHashCount.fetch_sub(1, std::memory_order_relaxed);
+            implicitProducerHashResizeInProgress.clear(std::memory_order_relaxed);
+            return nullptr;
+          }
+
+          auto newHash      = new (raw) ImplicitProducerHash;
+          newHash->capacity = static_cast<size_t>(newCapacity);
+          newHash->entries  = reinterpret_cast<ImplicitProducerKVP *>(details::align_for<ImplicitProducerKVP>(raw + sizeof(ImplicitProducerHash)));
+          for (size_t i = 0; i != newCapacity; ++i) {
+            new (newHash->entries + i) ImplicitProducerKVP;
+            newHash->entries[i].key.store(details::invalid_thread_id, std::memory_order_relaxed);
+          }
+          newHash->prev = mainHash;
+          implicitProducerHash.store(newHash, std::memory_order_release);
+          implicitProducerHashResizeInProgress.clear(std::memory_order_release);
+          mainHash = newHash;
+        } else
+          implicitProducerHashResizeInProgress.clear(std::memory_order_release);
+      }
+
+      // Below three-quarters full, insert into the current table rather than wait for another thread's resize.
+      if (newCount < (mainHash->capacity >> 1) + (mainHash->capacity >> 2)) {
+        // The count tracks hash slots, not producers, as in current upstream: recycling an exited thread's producer
+        // leaves it alone and reclaiming an exited thread's slot below gives the increment back. The older upstream
+        // these declarations come from, and so the server's own copy, decrements on recycling instead. That undercounts
+        // slots still held by exited threads, so under thread churn the table never grows and lookups spin once it
+        // has no empty slot left. Both variants add one and take back at most one per call, so sharing a queue with
+        // the server (e.g. Scheduler's mpmc::Sender<BackgroundTask>) can never underflow the count.
+        auto producer = static_cast<ImplicitProducer *>(recycle_or_create_producer(false));
+        if (producer == nullptr) {
+          implicitProducerHashCount.fetch_sub(1, std::memory_order_relaxed);
+          return nullptr;
+        }
+
+        producer->threadExitListener.callback = &ConcurrentQueue::implicit_producer_thread_exited_callback;
+        producer->threadExitListener.userData = producer;
+        details::ThreadExitNotifier::subscribe(&producer->threadExitListener);
+
+        auto index = hashedId;
+        while (true) {
+          index &= mainHash->capacity - 1u;
+          auto empty    = details::invalid_thread_id;
+          auto reusable = details::invalid_thread_id2;
+          if (mainHash->entries[index].key.compare_exchange_strong(reusable, id, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            // The slot of an exited thread was already counted.
+            implicitProducerHashCount.fetch_sub(1, std::memory_order_relaxed);
+            mainHash->entries[index].value = producer;
+            break;
+          }
+          if (mainHash->entries[index].key.compare_exchange_strong(empty, id, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            mainHash->entries[index].value = producer;
+            break;
+          }
+          ++index;
+        }
+        return producer;
+      }
+
+      // The table is nearly full and another thread is resizing it; wait for the new one.
+      mainHash = implicitProducerHash.load(std::memory_order_acquire);
+    }
+  }
+
+  // Called on the exiting thread: frees its hash slots in every table and marks the producer for reuse.
+  void implicit_producer_thread_exited(ImplicitProducer *producer) {
+    auto hash = implicitProducerHash.load(std::memory_order_acquire);
+    assert(hash != nullptr);
+    auto id       = details::thread_id();
+    auto hashedId = details::hash_thread_id(id);
+    details::thread_id_t probedKey;
+
+    // Every table is cleared, since another thread may reuse this producer while still on an older table.
+    for (; hash != nullptr; hash = hash->prev) {
+      auto index = hashedId;
+      do {
+        index &= hash->capacity - 1u;
+        probedKey = id;
+        if (hash->entries[index].key.compare_exchange_strong(probedKey, details::invalid_thread_id2, std::memory_order_seq_cst, std::memory_order_relaxed)) break;
+        ++index;
+      } while (probedKey != details::invalid_thread_id);
+    }
+
+    producer->inactive.store(true, std::memory_order_release);
+  }
+
+  static void implicit_producer_thread_exited_callback(void *userData) {
+    auto producer = static_cast<ImplicitProducer *>(userData);
+    auto queue    = producer->parent;
+    queue->implicit_producer_thread_exited(producer);
+  }
+
+  template <typename U> static inline U *create_array(size_t count) {
+    assert(count > 0);
+    auto p = static_cast<U *>((Traits::malloc)(sizeof(U) * count));
+    if (p == nullptr) return nullptr;
+    for (size_t i = 0; i != count; ++i) new (p + i) U();
+    return p;
+  }
+
+  template <typename U> static inline void destroy_array(U *p, size_t count) {
+    if (p != nullptr) {
+      assert(count > 0);
+      for (size_t i = count; i != 0;) (p + --i)->~U();
+      (Traits::free)(p);
+    }
+  }
+
+  template <typename U> static inline U *create() {
+    auto p = (Traits::malloc)(sizeof(U));
+    return p != nullptr ? new (p) U : nullptr;
+  }
+
+  template <typename U, typename A1> static inline U *create(A1 &&a1) {
+    auto p = (Traits::malloc)(sizeof(U));
+    return p != nullptr ? new (p) U(std::forward<A1>(a1)) : nullptr;
+  }
+
+  template <typename U> static inline void destroy(U *p) {
+    if (p != nullptr) {
+      p->~U();
+      (Traits::free)(p);
+    }
+  }
+
   std::atomic<ProducerBase *> producerListTail;
   std::atomic<std::uint32_t> producerCount;
   std::atomic<size_t> initialBlockPoolIndex;
@@ -254,34 +1929,60 @@ template <typename T, typename Traits = ConcurrentQueueDefaultTraits> class Conc
   std::atomic<std::uint32_t> globalExplicitConsumerOffset;
 };
 
+template <typename T, typename Traits> ProducerToken::ProducerToken(ConcurrentQueue<T, Traits> &queue) : producer(queue.recycle_or_create_producer(true)) {
+  if (producer != nullptr) producer->token = this;
+}
+
+template <typename T, typename Traits>
+ConsumerToken::ConsumerToken(ConcurrentQueue<T, Traits> &queue) : itemsConsumedFromCurrent(0), currentProducer(nullptr), desiredProducer(nullptr) {
+  initialOffset         = queue.nextExplicitConsumerId.fetch_add(1, std::memory_order_release);
+  lastKnownGlobalOffset = static_cast<std::uint32_t>(-1);
+}
+
 } // namespace moodycamel
 
 template <typename T> struct MPMCQueue {
   moodycamel::ConcurrentQueue<T> queue;
-  MPMCQueue();
-  bool push(T &&);
-  bool pop(T &);
-  ~MPMCQueue();
+  MPMCQueue() {}
+  bool push(T &&item) { return queue.enqueue(std::move(item)); }
+  bool pop(T &item) { return queue.try_dequeue(item); }
+  template <typename It> bool push_bulk(It first, std::size_t count) { return queue.enqueue_bulk(first, count); }
+  template <typename It> std::size_t pop_bulk(It first, std::size_t max) { return queue.try_dequeue_bulk(first, max); }
+  ~MPMCQueue() {}
 };
 
 namespace mpmc {
 template <typename T> struct Receiver {
   std::shared_ptr<MPMCQueue<T>> ptr;
-  Receiver();
-  Receiver(std::shared_ptr<MPMCQueue<T>> ptr);
-  Receiver &operator=(Receiver &&);
-  bool pop(T &);
-  ~Receiver();
+  Receiver() {}
+  Receiver(std::shared_ptr<MPMCQueue<T>> ptr) : ptr(std::move(ptr)) {}
+  Receiver &operator=(Receiver &&other) {
+    ptr = std::move(other.ptr);
+    return *this;
+  }
+  bool pop(T &item) { return ptr->pop(item); }
+  // Moves up to max items to out in one pass over each producer's blocks.
+  template <typename It> std::size_t pop_bulk(It out, std::size_t max) { return ptr->pop_bulk(out, max); }
+  ~Receiver() {}
 };
 template <typename T> struct Sender {
   std::shared_ptr<MPMCQueue<T>> ptr;
-  Sender();
-  Sender(std::shared_ptr<MPMCQueue<T>> ptr);
-  Sender(Sender &&);
-  Sender(Sender const &);
-  Sender &operator=(Sender &&);
-  bool push(T &&);
-  ~Sender();
+  Sender() {}
+  Sender(std::shared_ptr<MPMCQueue<T>> ptr) : ptr(std::move(ptr)) {}
+  Sender(Sender &&other) : ptr(std::move(other.ptr)) {}
+  Sender(Sender const &other) : ptr(other.ptr) {}
+  Sender &operator=(Sender &&other) {
+    ptr = std::move(other.ptr);
+    return *this;
+  }
+  bool push(T &&item) { return ptr->push(std::move(item)); }
+  template <typename It> bool push_bulk(It first, std::size_t count) { return ptr->push_bulk(first, count); }
+  ~Sender() {}
 };
-template <typename T> void makeQueue(Sender<T> &, Receiver<T> &);
-} // namespace mpmc
\ No newline at end of file
+// Connects a new queue to the given ends. Senders can be copied to any number of producer threads.
+template <typename T> void makeQueue(Sender<T> &sender, Receiver<T> &receiver) {
+  auto queue = std::make_shared<MPMCQueue<T>>();
+  sender     = Sender<T>{ queue };
+  receiver   = Receiver<T>{ std::move(queue) };
+}
+} // namespace mpmc
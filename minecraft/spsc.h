@@ -1,27 +1,245 @@
 #pragma once
 
 #include "Lockless.h"
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
 
+// moodycamel::ReaderWriterQueue as built into the server: a ring of blocks, each a power-of-two circular buffer. The
+// producer only writes tail/localFront and the consumer only writes front/localTail, and each pair sits on its own cache
+// line. Everything is inline so mods can instantiate it with their own T.
 template <typename T, std::size_t size = 512ul> struct SPSCQueue {
   struct Block {
-    char filler[160];
-    Block(uint64_t const &, char *, char *);
+    Lockless::WeakAtomic<std::size_t> front; // 0
+    std::size_t localTail;                   // 8
+    char filler16[48];
+    Lockless::WeakAtomic<std::size_t> tail; // 64
+    std::size_t localFront;                 // 72
+    char filler80[48];
+    Lockless::WeakAtomic<Block *> next; // 128
+    char *data;                         // 136
+    std::size_t const sizeMask;         // 144
+    char *rawThis;                      // 152
+    Block(uint64_t const &capacity, char *rawThis, char *data)
+        : front(0ul), localTail(0), tail(0ul), localFront(0), next(nullptr), data(data), sizeMask(capacity - 1), rawThis(rawThis) {}
   };
-  enum class AllocationMode {};
+  enum class AllocationMode { CanAlloc, CannotAlloc };
   Lockless::WeakAtomic<Block *> head; // 0
   char filler8[56];
   Lockless::WeakAtomic<Block *> tail; // 64
   std::size_t number;                 // 72
-  template <typename U> static std::size_t align_for(char *);
-  static void *make_block(std::size_t number);
-  static std::size_t ceilToPow2(std::size_t number);
-  template <typename U> bool enqueue(U &&);
-  bool enqueue_copy(T const &);
-  template <AllocationMode mode, typename U> bool inner_enqueue(U &&);
-  template <typename U> bool try_dequeue(U &);
-  std::size_t size_approx() const;
-  SPSCQueue(uint64_t);
-  ~SPSCQueue();
+
+  template <typename U> static char *align_for(char *ptr) {
+    std::size_t alignment = alignof(U);
+    return ptr + (alignment - (reinterpret_cast<uintptr_t>(ptr) % alignment)) % alignment;
+  }
+
+  static Block *make_block(std::size_t number) {
+    auto bytes = sizeof(Block) + alignof(Block) - 1 + sizeof(T) * number + alignof(T) - 1;
+    auto raw   = static_cast<char *>(std::malloc(bytes));
+    if (raw == nullptr) return nullptr;
+    auto block = align_for<Block>(raw);
+    return new (block) Block(number, raw, align_for<T>(block + sizeof(Block)));
+  }
+
+  static std::size_t ceilToPow2(std::size_t number) {
+    --number;
+    for (std::size_t shift = 1; shift < sizeof(std::size_t) * 8; shift <<= 1) number |= number >> shift;
+    return ++number;
+  }
+
+  template <typename U> bool enqueue(U &&element) { return inner_enqueue<AllocationMode::CanAlloc>(std::forward<U>(element)); }
+  bool enqueue_copy(T const &element) { return inner_enqueue<AllocationMode::CanAlloc>(element); }
+  template <typename U> bool try_enqueue(U &&element) { return inner_enqueue<AllocationMode::CannotAlloc>(std::forward<U>(element)); }
+
+  template <AllocationMode mode, typename U> bool inner_enqueue(U &&element) {
+    Block *block        = tail.load();
+    std::size_t front   = block->localFront;
+    std::size_t current = block->tail.load();
+    std::size_t next    = (current + 1) & block->sizeMask;
+    if (next != front || next != (block->localFront = block->front.load())) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      new (block->data + current * sizeof(T)) T(std::forward<U>(element));
+      std::atomic_thread_fence(std::memory_order_release);
+      block->tail = next;
+      return true;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (block->next.load() != head.load()) {
+      // The consumer has drained the following block, so it can be reused.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      Block *following       = block->next.load();
+      following->localFront  = following->front.load();
+      std::size_t followTail = following->tail.load();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      new (following->data + followTail * sizeof(T)) T(std::forward<U>(element));
+      following->tail = (followTail + 1) & following->sizeMask;
+      std::atomic_thread_fence(std::memory_order_release);
+      tail = following;
+      return true;
+    }
+    if constexpr (mode == AllocationMode::CannotAlloc) return false;
+    auto blockSize = number >= size ? number : number * 2;
+    auto fresh     = make_block(blockSize);
+    if (fresh == nullptr) return false;
+    number = blockSize;
+    new (fresh->data) T(std::forward<U>(element));
+    fresh->tail = fresh->localTail = 1;
+    fresh->next                    = block->next.load();
+    block->next                    = fresh;
+    std::atomic_thread_fence(std::memory_order_release);
+    tail = fresh;
+    return true;
+  }
+
+  template <typename U> bool try_dequeue(U &result) {
+    Block *block      = head.load();
+    std::size_t limit = block->localTail;
+    std::size_t front = block->front.load();
+    if (front == limit && front == (block->localTail = block->tail.load())) {
+      if (block == tail.load()) return false;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      block = head.load();
+      limit = block->localTail = block->tail.load();
+      front = block->front.load();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (front == limit) {
+        // The producer has moved on and only advances tail after writing, so the next block is never empty.
+        block = block->next.load();
+        front = block->front.load();
+        block->localTail = block->tail.load();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_release);
+        head = block;
+        std::atomic_signal_fence(std::memory_order_release);
+      }
+    } else
+      std::atomic_thread_fence(std::memory_order_acquire);
+    auto element = reinterpret_cast<T *>(block->data + front * sizeof(T));
+    result       = std::move(*element);
+    element->~T();
+    std::atomic_thread_fence(std::memory_order_release);
+    block->front = (front + 1) & block->sizeMask;
+    return true;
+  }
+
+  // Fills each block's free slots in one go with a single release per block; falls back to enqueue() to move to the
+  // next block.
+  template <typename It> bool enqueue_bulk(It first, std::size_t count) {
+    while (count) {
+      Block *block        = tail.load();
+      std::size_t current = block->tail.load();
+      std::size_t front   = block->localFront = block->front.load();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      std::size_t written = 0;
+      for (std::size_t next = (current + 1) & block->sizeMask; next != front && written < count; next = (next + 1) & block->sizeMask) {
+        new (block->data + current * sizeof(T)) T(*first);
+        ++first;
+        current = next;
+        written++;
+      }
+      if (written) {
+        std::atomic_thread_fence(std::memory_order_release);
+        block->tail = current;
+        count -= written;
+        continue;
+      }
+      if (!enqueue(*first)) return false;
+      ++first;
+      count--;
+    }
+    return true;
+  }
+
+  // Moves up to max elements to out, releasing each block's slots once instead of per element.
+  template <typename It> std::size_t try_dequeue_bulk(It out, std::size_t max) {
+    std::size_t count = 0;
+    while (count < max) {
+      Block *block      = head.load();
+      std::size_t front = block->front.load();
+      std::size_t limit = block->localTail = block->tail.load();
+      if (front == limit) {
+        if (block == tail.load()) break;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (front != (block->localTail = block->tail.load())) continue;
+        std::atomic_thread_fence(std::memory_order_release);
+        head = block->next.load();
+        continue;
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      for (; front != limit && count < max; front = (front + 1) & block->sizeMask, count++) {
+        auto element = reinterpret_cast<T *>(block->data + front * sizeof(T));
+        *out         = std::move(*element);
+        ++out;
+        element->~T();
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      block->front = front;
+    }
+    return count;
+  }
+
+  std::size_t size_approx() const {
+    std::size_t result = 0;
+    Block *first       = head.load();
+    Block *block       = first;
+    do {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      result += (block->tail.load() - block->front.load()) & block->sizeMask;
+      block = block->next.load();
+    } while (block != first);
+    return result;
+  }
+
+  // Preallocates room for at least `number` elements without further allocation.
+  SPSCQueue(uint64_t number = 15) {
+    Block *first = nullptr;
+    this->number = ceilToPow2(number + 1);
+    if (this->number > size * 2) {
+      // A spare block lets the producer fill one block while the consumer is still reading another, and every block
+      // keeps one slot free so that front == tail always means empty.
+      std::size_t blocks = (number + size * 2 - 3) / (size - 1);
+      this->number       = size;
+      Block *last        = nullptr;
+      for (std::size_t i = 0; i != blocks; ++i) {
+        auto block = make_block(this->number);
+        if (block == nullptr) throw std::bad_alloc();
+        if (first == nullptr)
+          first = block;
+        else
+          last->next = block;
+        last        = block;
+        block->next = first;
+      }
+    } else {
+      first = make_block(this->number);
+      if (first == nullptr) throw std::bad_alloc();
+      first->next = first;
+    }
+    head = first;
+    tail = first;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  SPSCQueue(SPSCQueue const &) = delete;
+  SPSCQueue &operator=(SPSCQueue const &) = delete;
+
+  ~SPSCQueue() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Block *first = head.load();
+    Block *block = first;
+    do {
+      Block *next = block->next.load();
+      for (std::size_t i = block->front.load(), end = block->tail.load(); i != end; i = (i + 1) & block->sizeMask)
+        reinterpret_cast<T *>(block->data + i * sizeof(T))->~T();
+      auto raw = block->rawThis;
+      block->~Block();
+      std::free(raw);
+      block = next;
+    } while (block != first);
+  }
 };
 
-static_assert(sizeof(SPSCQueue<int, 512>) == 80);
\ No newline at end of file
+static_assert(sizeof(SPSCQueue<int, 512>::Block) == 160);
+static_assert(sizeof(SPSCQueue<int, 512>) == 80);